@@ -69,6 +69,9 @@ static gboolean timer_callback(gpointer data) {
     g_assert(timer != NULL);
     g_assert(timer->func != NULL);
 
+    /* the source gets destroyed when we return FALSE; func may re-arm */
+    timer->source = NULL;
+
     timer->func(timer->opaque);
 
     return FALSE;
@@ -88,6 +91,9 @@ static void timer_start(SpiceTimer *timer, uint32_t ms) {
     g_source_set_callback(timer->source, timer_callback, timer, NULL);
 
     g_source_attach(timer->source, NULL);
+
+    /* the main context holds a reference until the source is destroyed */
+    g_source_unref(timer->source);
 }
 
 static void timer_cancel(SpiceTimer *timer) {
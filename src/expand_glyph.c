@@ -0,0 +1,94 @@
+/*
+
+     Copyright (C) 2013 Proxmox Server Solutions GmbH
+
+     Copyright: spiceterm is under GNU GPL, the GNU General Public License.
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation; version 2 dated June, 1991.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+     02111-1307, USA.
+
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "expand_glyph.h"
+
+void expand_glyph_scalar(
+    uint32_t *dst, int stride, const uint8_t rows[16], uint32_t fg, uint32_t bg
+) {
+    for (int j = 0; j < 16; j++) {
+        uint32_t *p = dst + j * stride;
+        uint8_t d = rows[j];
+        for (int i = 0; i < 8; i++) {
+            p[i] = (d & (0x80 >> i)) ? fg : bg;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* per pixel: bg ^ ((fg ^ bg) & mask), with mask = all ones if the bit is set */
+
+__attribute__((target("sse2"))) void expand_glyph_sse2(
+    uint32_t *dst, int stride, const uint8_t rows[16], uint32_t fg, uint32_t bg
+) {
+    const __m128i bits_lo = _mm_set_epi32(0x10, 0x20, 0x40, 0x80);
+    const __m128i bits_hi = _mm_set_epi32(0x01, 0x02, 0x04, 0x08);
+    const __m128i bgv = _mm_set1_epi32(bg);
+    const __m128i diff = _mm_set1_epi32(fg ^ bg);
+
+    for (int j = 0; j < 16; j++) {
+        __m128i d = _mm_set1_epi32(rows[j]);
+        __m128i m_lo = _mm_cmpeq_epi32(_mm_and_si128(d, bits_lo), bits_lo);
+        __m128i m_hi = _mm_cmpeq_epi32(_mm_and_si128(d, bits_hi), bits_hi);
+        uint32_t *p = dst + j * stride;
+
+        _mm_storeu_si128((__m128i *)p, _mm_xor_si128(bgv, _mm_and_si128(diff, m_lo)));
+        _mm_storeu_si128((__m128i *)(p + 4), _mm_xor_si128(bgv, _mm_and_si128(diff, m_hi)));
+    }
+}
+
+__attribute__((target("avx2"))) void expand_glyph_avx2(
+    uint32_t *dst, int stride, const uint8_t rows[16], uint32_t fg, uint32_t bg
+) {
+    const __m256i bits = _mm256_set_epi32(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80);
+    const __m256i bgv = _mm256_set1_epi32(bg);
+    const __m256i diff = _mm256_set1_epi32(fg ^ bg);
+
+    for (int j = 0; j < 16; j++) {
+        __m256i d = _mm256_set1_epi32(rows[j]);
+        __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(d, bits), bits);
+
+        _mm256_storeu_si256(
+            (__m256i *)(dst + j * stride), _mm256_xor_si256(bgv, _mm256_and_si256(diff, mask))
+        );
+    }
+}
+
+#endif
+
+expand_glyph_func expand_glyph_best(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return expand_glyph_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return expand_glyph_sse2;
+    }
+#endif
+    return expand_glyph_scalar;
+}
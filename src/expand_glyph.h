@@ -0,0 +1,43 @@
+/*
+
+     Copyright (C) 2013 Proxmox Server Solutions GmbH
+
+     Copyright: spiceterm is under GNU GPL, the GNU General Public License.
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation; version 2 dated June, 1991.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+     02111-1307, USA.
+
+*/
+
+#include <stdint.h>
+
+/* Expand the 16 rows of a 8x16 1bpp glyph into BGRX pixels, using fg where
+ * a bit is set and bg otherwise ('stride' is in pixels). All kernels produce
+ * the same output, check with 'make check-expand-glyph'.
+ */
+typedef void (*expand_glyph_func)(
+    uint32_t *dst, int stride, const uint8_t rows[16], uint32_t fg, uint32_t bg
+);
+
+void expand_glyph_scalar(
+    uint32_t *dst, int stride, const uint8_t rows[16], uint32_t fg, uint32_t bg
+);
+
+#if defined(__x86_64__) || defined(__i386__)
+void expand_glyph_sse2(uint32_t *dst, int stride, const uint8_t rows[16], uint32_t fg, uint32_t bg);
+void expand_glyph_avx2(uint32_t *dst, int stride, const uint8_t rows[16], uint32_t fg, uint32_t bg);
+#endif
+
+// the fastest kernel the CPU supports
+expand_glyph_func expand_glyph_best(void);
@@ -0,0 +1,163 @@
+/*
+
+     Copyright (C) 2013 Proxmox Server Solutions GmbH
+
+     Copyright: spiceterm is under GNU GPL, the GNU General Public License.
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation; version 2 dated June, 1991.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+     02111-1307, USA.
+
+*/
+
+/* Check that the glyph expansion kernels produce the same pixels as
+ * expand_glyph_scalar, and time them. Run with 'make check-expand-glyph'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "expand_glyph.h"
+#include "glyphs.h"
+
+#define STRIDE 24 // pixels, the glyph is drawn at column 8 (guard columns around it)
+#define CANARY 0xdeadbeef
+#define BENCH_ROUNDS 2000
+
+typedef struct Kernel {
+    const char *name;
+    expand_glyph_func func;
+} Kernel;
+
+// BGRX colors: the VGA palette plus values with the X byte and the sign bit set
+static const uint32_t colors[] = {
+    0x00000000, 0x00aa0000, 0x0000aa00, 0x00aa5500, 0x000000aa, 0x00aa00aa, 0x0000aaaa,
+    0x00aaaaaa, 0x00555555, 0x00ff5555, 0x0055ff55, 0x00ffff55, 0x005555ff, 0x00ff55ff,
+    0x0055ffff, 0x00ffffff, 0xff000000, 0x80000001, 0xffffffff,
+};
+
+#define N_COLORS (int)(sizeof(colors) / sizeof(colors[0]))
+
+static int kernel_list(Kernel *kernels) {
+    int n = 0;
+
+    kernels[n++] = (Kernel){"scalar", expand_glyph_scalar};
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        kernels[n++] = (Kernel){"sse2", expand_glyph_sse2};
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[n++] = (Kernel){"avx2", expand_glyph_avx2};
+    }
+#endif
+    return n;
+}
+
+static void expand(expand_glyph_func func, uint32_t *buf, const uint8_t rows[16], int fg, int bg) {
+    for (int i = 0; i < 18 * STRIDE; i++) {
+        buf[i] = CANARY;
+    }
+    func(buf + STRIDE + 8, STRIDE, rows, colors[fg], colors[bg]);
+}
+
+/* Every row value in every row, for every fg/bg pair. The scalar kernel
+ * is checked against the definition, the others against the scalar one
+ * (including the guard pixels around the cell, which must stay untouched).
+ */
+static int check(Kernel *kernels, int n_kernels) {
+    uint32_t ref[18 * STRIDE], out[18 * STRIDE];
+    uint8_t rows[16];
+    int errors = 0;
+
+    for (int p = 0; p < 256; p++) {
+        for (int j = 0; j < 16; j++) {
+            rows[j] = p ^ (j * 0x11);
+        }
+        for (int fg = 0; fg < N_COLORS; fg++) {
+            for (int bg = 0; bg < N_COLORS; bg++) {
+                expand(expand_glyph_scalar, ref, rows, fg, bg);
+                for (int i = 0; i < 18 * STRIDE; i++) {
+                    int x = i % STRIDE - 8, y = i / STRIDE - 1;
+                    uint32_t want = CANARY;
+                    if (x >= 0 && x < 8 && y >= 0 && y < 16) {
+                        want = (rows[y] & (0x80 >> x)) ? colors[fg] : colors[bg];
+                    }
+                    if (ref[i] != want && errors++ < 10) {
+                        fprintf(
+                            stderr, "scalar: pattern %d fg %d bg %d pixel %d,%d\n", p, fg, bg, x, y
+                        );
+                    }
+                }
+                for (int k = 1; k < n_kernels; k++) {
+                    expand(kernels[k].func, out, rows, fg, bg);
+                    if (memcmp(ref, out, sizeof(ref)) && errors++ < 10) {
+                        fprintf(
+                            stderr, "%s: pattern %d fg %d bg %d differs from scalar\n",
+                            kernels[k].name, p, fg, bg
+                        );
+                    }
+                }
+            }
+        }
+    }
+
+    return errors;
+}
+
+// ns per glyph, expanding the whole font into a text row
+static double bench(expand_glyph_func func) {
+    int glyphs = vt_font_size;
+    uint32_t *row = malloc(glyphs * 8 * 16 * sizeof(uint32_t));
+    struct timespec t1, t2;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (int c = 0; c < glyphs; c++) {
+            func(row + c * 8, glyphs * 8, vt_font_data + c * 16, colors[r & 15], colors[c & 15]);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    // keep the stores alive
+    volatile uint32_t sink = row[glyphs * 8 * 15 + 7];
+    (void)sink;
+    free(row);
+
+    double ns = (t2.tv_sec - t1.tv_sec) * 1e9 + (t2.tv_nsec - t1.tv_nsec);
+    return ns / ((double)BENCH_ROUNDS * glyphs);
+}
+
+int main(int argc, char **argv) {
+    Kernel kernels[3];
+    int n_kernels = kernel_list(kernels);
+
+    int errors = check(kernels, n_kernels);
+    if (errors) {
+        fprintf(stderr, "expand_glyph: %d mismatches\n", errors);
+        exit(1);
+    }
+
+    double scalar = 0;
+    for (int k = 0; k < n_kernels; k++) {
+        double ns = bench(kernels[k].func);
+        if (!k) {
+            scalar = ns;
+        }
+        printf("%-8s ok %7.1f ns/glyph %5.2fx\n", kernels[k].name, ns, scalar / ns);
+    }
+
+    exit(0);
+}
@@ -272,10 +272,7 @@ static void my_kbd_push_key(SpiceKbdInstance *sin, uint8_t frag) {
         DPRINTF(1, "escape=%s", esc);
         spiceterm_respond_esc(vt, esc);
 
-        if (vt->y_displ != vt->y_base) {
-            vt->y_displ = vt->y_base;
-            spiceterm_refresh(vt);
-        }
+        spiceterm_show_live_view(vt);
 
         spiceterm_update_watch_mask(vt, TRUE);
     } else if (frag < 128) {
@@ -829,7 +826,7 @@ spiceTerm *spiceterm_create(uint32_t width, uint32_t height, SpiceTermOptions *o
         return NULL;
     }
 
-    spice_screen->image_cache = g_hash_table_new(g_int_hash, g_int_equal);
+    spice_screen->image_cache = g_hash_table_new(g_int64_hash, g_int64_equal);
 
     spiceTerm *vt = (spiceTerm *)calloc(sizeof(spiceTerm), 1);
 
@@ -840,6 +837,8 @@ spiceTerm *spiceterm_create(uint32_t width, uint32_t height, SpiceTermOptions *o
     vt->vdagent_sin.subtype = "vdagent";
     spice_server_add_interface(spice_screen->server, &vt->vdagent_sin.base);
     vt->screen = spice_screen;
+    vt->flush_interval = vt->min_flush_interval = opts->flush_interval;
+    vt->max_flush_interval = opts->max_flush_interval;
 
     init_spiceterm(vt, width, height);
 
@@ -0,0 +1,104 @@
+/*
+
+     Copyright (C) 2013 Proxmox Server Solutions GmbH
+
+     Copyright: spiceterm is under GNU GPL, the GNU General Public License.
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation; version 2 dated June, 1991.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+     02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "pool.h"
+
+#define POOL_CACHE_LINE 64
+#define POOL_SLAB_SIZE (64 * 1024)
+
+struct PoolObject {
+    PoolObject *next;
+};
+
+void pool_init(Pool *pool, const char *name, gsize object_size) {
+    memset(pool, 0, sizeof(*pool));
+
+    pool->name = name;
+    pool->object_size = (object_size + POOL_CACHE_LINE - 1) & ~(gsize)(POOL_CACHE_LINE - 1);
+    pool->slab_objects = MAX(1, POOL_SLAB_SIZE / pool->object_size);
+}
+
+static void pool_add_slab(Pool *pool) {
+    void *slab;
+    guint i;
+
+    if (posix_memalign(&slab, POOL_CACHE_LINE, pool->object_size * pool->slab_objects) != 0) {
+        g_error("pool '%s': out of memory", pool->name);
+    }
+
+    for (i = pool->slab_objects; i-- > 0;) {
+        PoolObject *obj = (PoolObject *)((guint8 *)slab + i * pool->object_size);
+        obj->next = pool->free_list;
+        pool->free_list = obj;
+    }
+
+    pool->slabs++;
+}
+
+gpointer pool_alloc0(Pool *pool) {
+    PoolObject *obj;
+
+    if (!pool->free_list) {
+        /* take over everything freed in the meantime */
+        do {
+            obj = g_atomic_pointer_get(&pool->returned);
+        } while (!g_atomic_pointer_compare_and_exchange(&pool->returned, obj, NULL));
+
+        pool->free_list = obj;
+    }
+
+    if (!pool->free_list) {
+        pool_add_slab(pool);
+    }
+
+    obj = pool->free_list;
+    pool->free_list = obj->next;
+    pool->allocs++;
+
+    memset(obj, 0, pool->object_size);
+
+    return obj;
+}
+
+void pool_free(Pool *pool, gpointer data) {
+    PoolObject *obj = data;
+    PoolObject *head;
+
+    do {
+        head = g_atomic_pointer_get(&pool->returned);
+        obj->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange(&pool->returned, head, obj));
+
+    g_atomic_int_inc(&pool->frees);
+}
+
+void pool_get_stats(Pool *pool, PoolStats *stats) {
+    stats->slabs = pool->slabs;
+    stats->objects = pool->slabs * pool->slab_objects;
+    stats->in_use = (guint)pool->allocs - (guint)g_atomic_int_get(&pool->frees);
+    stats->allocs = pool->allocs;
+}
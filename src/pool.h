@@ -0,0 +1,56 @@
+/*
+
+     Copyright (C) 2013 Proxmox Server Solutions GmbH
+
+     Copyright: spiceterm is under GNU GPL, the GNU General Public License.
+
+     This program is free software; you can redistribute it and/or modify
+     it under the terms of the GNU General Public License as published by
+     the Free Software Foundation; version 2 dated June, 1991.
+
+     This program is distributed in the hope that it will be useful,
+     but WITHOUT ANY WARRANTY; without even the implied warranty of
+     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+     GNU General Public License for more details.
+
+     You should have received a copy of the GNU General Public License
+     along with this program; if not, write to the Free Software
+     Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+     02111-1307, USA.
+
+*/
+
+#include <glib.h>
+
+/* Fixed size object pool. Objects are carved out of cache line aligned
+ * slabs, which are never given back to the system.
+ * pool_alloc0() must always be called from the same thread, pool_free()
+ * may be called from any thread.
+ */
+
+typedef struct PoolObject PoolObject;
+
+typedef struct Pool {
+    const char *name;
+    gsize object_size;
+    guint slab_objects;
+
+    PoolObject *free_list; // only used by the allocating thread
+    PoolObject *returned; // lock-free stack filled by pool_free()
+
+    guint slabs;
+    guint64 allocs;
+    gint frees; // atomic
+} Pool;
+
+typedef struct PoolStats {
+    guint slabs;
+    guint objects;
+    guint in_use;
+    guint64 allocs;
+} PoolStats;
+
+void pool_init(Pool *pool, const char *name, gsize object_size);
+gpointer pool_alloc0(Pool *pool);
+void pool_free(Pool *pool, gpointer data);
+void pool_get_stats(Pool *pool, PoolStats *stats);
@@ -24,13 +24,17 @@
 
 */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <math.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <wait.h>
@@ -43,6 +47,8 @@
 
 #include "glyphs.h"
 
+#include "expand_glyph.h"
+#include "pool.h"
 #include "spiceterm.h"
 
 static int debug = 0;
@@ -73,10 +79,33 @@ typedef struct __attribute__((__packed__)) SimpleSpiceUpdate {
     QXLCommandExt ext; // needs to be first member
     QXLDrawable drawable;
     QXLImage image;
-    uint8_t *bitmap;
-    int cache_id; // do not free bitmap if cache_id != 0
+    uint8_t *bitmap; // freed on release (NULL for cached images)
+    CachedImage *cached; // referenced until release
 } SimpleSpiceUpdate;
 
+typedef struct SimpleSurfaceCmd {
+    QXLCommandExt ext; // needs to be first member
+    QXLSurfaceCmd surface_cmd;
+} SimpleSurfaceCmd;
+
+typedef struct SimpleSpiceCursor {
+    QXLCommandExt ext; // needs to be first member
+    QXLCursorCmd cmd;
+} SimpleSpiceCursor;
+
+/* updates are allocated by the main thread, cursor commands by the
+ * red_worker thread; both are released by the red_worker thread */
+static Pool update_pool;
+static Pool cursor_pool;
+
+/* Note: may be called from the red_worker thread (release_resource) */
+static void cached_image_unref(CachedImage *ce) {
+    if (g_atomic_int_dec_and_test(&ce->refcount)) {
+        g_free(ce->bitmap);
+        g_free(ce);
+    }
+}
+
 static void spice_screen_destroy_update(SimpleSpiceUpdate *update) {
     if (!update) {
         return;
@@ -85,11 +114,14 @@ static void spice_screen_destroy_update(SimpleSpiceUpdate *update) {
         uint8_t *ptr = (uint8_t *)update->drawable.clip.data;
         free(ptr);
     }
-    if (update->bitmap && !update->cache_id) {
+    if (update->cached) {
+        cached_image_unref(update->cached);
+    }
+    if (update->bitmap) {
         g_free(update->bitmap);
     }
 
-    g_free(update);
+    pool_free(&update_pool, update);
 }
 
 static void release_qxl_command_ext(QXLCommandExt *ext) {
@@ -100,16 +132,11 @@ static void release_qxl_command_ext(QXLCommandExt *ext) {
         spice_screen_destroy_update((void *)ext);
         break;
     case QXL_CMD_SURFACE:
-        free(ext);
+        g_free(ext);
         break;
-    case QXL_CMD_CURSOR: {
-        QXLCursorCmd *cmd = (QXLCursorCmd *)(unsigned long)ext->cmd.data;
-        if (cmd->type == QXL_CURSOR_SET) {
-            free(cmd);
-        }
-        free(ext);
+    case QXL_CMD_CURSOR:
+        pool_free(&cursor_pool, ext);
         break;
-    }
     default:
         abort();
     }
@@ -122,7 +149,14 @@ static void release_resource(QXLInstance *qin, struct QXLReleaseInfoExt release_
     release_qxl_command_ext(ext);
 }
 
-static int unique = 0x0ffff + 1;
+/* Image ids: cached glyphs use IMAGE_ID_GLYPH | glyph_cache_key(), cached
+ * text spans IMAGE_ID_SPAN | a hash of their cells (see span_cache_id), all
+ * other images get a fresh serial number, so they never collide.
+ */
+#define IMAGE_ID_GLYPH (1ULL << 63)
+#define IMAGE_ID_SPAN (1ULL << 62)
+
+static uint64_t unique = 0;
 
 static void set_cmd(QXLCommandExt *ext, uint32_t type, QXLPHYSICAL data) {
     ext->cmd.type = type;
@@ -137,37 +171,141 @@ static void simple_set_release_info(QXLReleaseInfo *info, intptr_t ptr) {
     // info->group_id = MEM_SLOT_GROUP_ID;
 }
 
-/* Note: push_command/get_command are called from different threads */
+/* max. number of queued commands inspected by supersede_commands() */
+#define SUPERSEDE_SCAN_LIMIT 64
 
-static void push_command(SpiceScreen *spice_screen, QXLCommandExt *ext) {
-    int need_wakeup = 1;
+/* drawables which paint every pixel of their bbox without reading it */
+static QXLDrawable *opaque_paint_drawable(QXLCommandExt *ext) {
+    if (ext->cmd.type != QXL_CMD_DRAW) {
+        return NULL;
+    }
 
-    g_mutex_lock(&spice_screen->command_mutex);
+    QXLDrawable *drawable = (QXLDrawable *)(intptr_t)ext->cmd.data;
 
-    while (spice_screen->commands_end - spice_screen->commands_start >= COMMANDS_SIZE) {
-        g_cond_wait(&spice_screen->command_cond, &spice_screen->command_mutex);
+    if (drawable->effect != QXL_EFFECT_OPAQUE || drawable->clip.type != SPICE_CLIP_TYPE_NONE) {
+        return NULL;
     }
 
-    g_assert(spice_screen->commands_end - spice_screen->commands_start < COMMANDS_SIZE);
+    if (drawable->surfaces_dest[0] != -1) {
+        return NULL; // reads another surface (see spice_screen_save_page)
+    }
 
-    if ((spice_screen->commands_end - spice_screen->commands_start) > 0) {
-        need_wakeup = 0;
+    switch (drawable->type) {
+    case QXL_DRAW_COPY:
+        if (drawable->u.copy.rop_descriptor != SPICE_ROPD_OP_PUT ||
+            drawable->u.copy.mask.bitmap) {
+            return NULL;
+        }
+        return drawable;
+    case QXL_DRAW_FILL:
+        if (drawable->u.fill.brush.type != SPICE_BRUSH_TYPE_SOLID ||
+            drawable->u.fill.rop_descriptor != SPICE_ROPD_OP_PUT || drawable->u.fill.mask.bitmap) {
+            return NULL;
+        }
+        return drawable;
+    default:
+        return NULL;
     }
+}
 
-    spice_screen->commands[spice_screen->commands_end % COMMANDS_SIZE] = ext;
-    spice_screen->commands_end++;
+static gboolean rect_contains(const QXLRect *outer, const QXLRect *inner) {
+    return inner->left >= outer->left && inner->right <= outer->right &&
+           inner->top >= outer->top && inner->bottom <= outer->bottom;
+}
 
-    if (need_wakeup) {
-        spice_qxl_wakeup(&spice_screen->qxl_instance);
-        // spice_screen->qxl_worker->wakeup(spice_screen->qxl_worker);
+/* Release queued (not yet consumed) draw commands which are completely
+ * painted over by 'ext'. The decision only uses the producer private
+ * command_info, because the worker may consume (and release) a command at
+ * any time. A command is claimed by exchanging its slot with NULL; if the
+ * worker was faster, the slot is already NULL and nothing happens. Stops at
+ * the first command which reads from the screen (i.e. QXL_COPY_BITS),
+ * because older pixels matter for that one.
+ */
+static void supersede_commands(SpiceScreen *spice_screen, const QueuedCommandInfo *info) {
+    unsigned int end, start, pos, count;
+
+    if (!info->opaque_paint) {
+        return;
+    }
+
+    end = atomic_load_explicit(&spice_screen->commands_end, memory_order_relaxed);
+    start = atomic_load_explicit(&spice_screen->commands_start, memory_order_acquire);
+
+    count = MIN(end - start, SUPERSEDE_SCAN_LIMIT);
+    for (pos = end - 1; count > 0; pos--, count--) {
+        QueuedCommandInfo *old_info = &spice_screen->command_info[pos % COMMANDS_SIZE];
+        if (!old_info->opaque_paint) {
+            break;
+        }
+
+        if (old_info->surface_id == info->surface_id &&
+            rect_contains(&info->bbox, &old_info->bbox)) {
+            QXLCommandExt *old = atomic_exchange_explicit(
+                &spice_screen->commands[pos % COMMANDS_SIZE], NULL, memory_order_acquire
+            );
+            if (old) {
+                release_qxl_command_ext(old);
+            }
+        }
+    }
+}
+
+/* Note: push_command/get_command are called from different threads.
+ * There is exactly one producer (main loop) and one consumer (red_worker),
+ * so the ring needs no lock. The worker is only woken up if it could have
+ * seen an empty ring; see req_cmd_notification() for the other half.
+ */
+
+/* The main loop never waits for the worker. The spice_screen_draw_*()
+ * functions check for a free slot first and fail if the ring is full; only
+ * the producer adds entries, so the slot is still free when pushing.
+ */
+static gboolean command_ring_full(SpiceScreen *spice_screen) {
+    unsigned int end = atomic_load_explicit(&spice_screen->commands_end, memory_order_relaxed);
+
+    if (end - atomic_load_explicit(&spice_screen->commands_start, memory_order_acquire) <
+        COMMANDS_SIZE) {
+        return FALSE;
     }
 
-    g_mutex_unlock(&spice_screen->command_mutex);
+    spice_screen->ring_full_count++;
+
+    return TRUE;
+}
+
+static void push_command(SpiceScreen *spice_screen, QXLCommandExt *ext) {
+    QueuedCommandInfo info = {0};
+    QXLDrawable *drawable = opaque_paint_drawable(ext);
+    unsigned int end;
+
+    if (drawable) {
+        info.bbox = drawable->bbox;
+        info.surface_id = drawable->surface_id;
+        info.opaque_paint = TRUE;
+    }
+
+    supersede_commands(spice_screen, &info);
+
+    g_assert(!command_ring_full(spice_screen));
+
+    end = atomic_load_explicit(&spice_screen->commands_end, memory_order_relaxed);
+
+    spice_screen->command_info[end % COMMANDS_SIZE] = info;
+    atomic_store_explicit(&spice_screen->commands[end % COMMANDS_SIZE], ext, memory_order_relaxed);
+    atomic_store_explicit(&spice_screen->commands_end, end + 1, memory_order_release);
+
+    // pairs with the fence in req_cmd_notification()
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(&spice_screen->commands_start, memory_order_relaxed) == end) {
+        spice_qxl_wakeup(&spice_screen->qxl_instance);
+    }
 }
 
-/* bitmap are freed, so they must be allocated with g_malloc */
+/* bitmap are freed, so they must be allocated with g_malloc - unless a
+ * cache_id is given, then the caller has to keep the bitmap alive */
 static SimpleSpiceUpdate *spice_screen_update_from_bitmap_cmd(
-    uint32_t surface_id, QXLRect bbox, uint8_t *bitmap, int cache_id
+    uint32_t surface_id, QXLRect bbox, uint8_t *bitmap, uint64_t cache_id
 ) {
     SimpleSpiceUpdate *update;
     QXLDrawable *drawable;
@@ -177,8 +315,8 @@ static SimpleSpiceUpdate *spice_screen_update_from_bitmap_cmd(
     bh = bbox.bottom - bbox.top;
     bw = bbox.right - bbox.left;
 
-    update = g_new0(SimpleSpiceUpdate, 1);
-    update->bitmap = bitmap;
+    update = pool_alloc0(&update_pool);
+    update->bitmap = cache_id ? NULL : bitmap;
     drawable = &update->drawable;
     image = &update->image;
 
@@ -199,11 +337,10 @@ static SimpleSpiceUpdate *spice_screen_update_from_bitmap_cmd(
     drawable->u.copy.src_area.bottom = bh;
 
     if (cache_id) {
-        QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_DEVICE, cache_id);
+        image->descriptor.id = cache_id;
         image->descriptor.flags = SPICE_IMAGE_FLAGS_CACHE_ME;
-        update->cache_id = cache_id;
     } else {
-        QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_DEVICE, ++unique);
+        image->descriptor.id = ++unique;
     }
     image->descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
     image->bitmap.flags = QXL_BITMAP_DIRECT | QXL_BITMAP_TOP_DOWN;
@@ -219,80 +356,531 @@ static SimpleSpiceUpdate *spice_screen_update_from_bitmap_cmd(
     return update;
 }
 
-static SimpleSpiceUpdate *spice_screen_draw_char_cmd(
-    SpiceScreen *spice_screen, int x, int y, int c, int fg, int bg, gboolean uline
+/* same as above, for a palettized bitmap ('palette' must stay alive) */
+static SimpleSpiceUpdate *spice_screen_update_from_palette_bitmap_cmd(
+    uint32_t surface_id, QXLRect bbox, uint8_t *bitmap, uint64_t cache_id, uint8_t format,
+    uint32_t stride, QXLPalette *palette
 ) {
-    uint8_t *bitmap = NULL;
-    QXLRect bbox;
-    int cache_id = 0;
-    CachedImage *ce;
+    SimpleSpiceUpdate *update =
+        spice_screen_update_from_bitmap_cmd(surface_id, bbox, bitmap, cache_id);
+    QXLImage *image = &update->image;
+
+    image->bitmap.format = format;
+    image->bitmap.stride = stride;
+    image->bitmap.palette = (intptr_t)palette;
+
+    return update;
+}
+
+static expand_glyph_func expand_glyph = expand_glyph_scalar;
+
+static uint32_t color_to_rgb(int col) {
+    col = color_table[col];
+    return (default_red[col] << 16) | (default_grn[col] << 8) | default_blu[col];
+}
+
+static uint32_t color_to_bgrx(int col) { return GUINT32_TO_LE(color_to_rgb(col)); }
+
+static void render_glyph(uint8_t *dst, int stride, int c, int fg, int bg, gboolean uline) {
+    uint8_t rows[16];
+
+    g_assert(fg >= 0 && fg < 16);
+    g_assert(bg >= 0 && bg < 16);
+
+    memcpy(rows, vt_font_data + c * 16, 16);
+    if (uline) {
+        rows[14] = 0xff;
+    }
+
+    expand_glyph((uint32_t *)dst, stride / 4, rows, color_to_bgrx(fg), color_to_bgrx(bg));
+}
+
+/* everything which makes up the bitmap of a glyph cell (bold is part of fg) */
+static uint64_t glyph_cache_key(int c, int fg, int bg, gboolean uline) {
+    return ((uint64_t)c << 16) | (uline ? 1 << 8 : 0) | (fg << 4) | bg;
+}
+
+/* Palettized text bitmaps (the default): a single glyph is sent as
+ * SPICE_BITMAP_FMT_1BIT_BE straight from the font data with a two entry
+ * palette, a span as SPICE_BITMAP_FMT_4BIT_BE with the 16 colour palette.
+ * That is 16 (64) bytes per glyph instead of 512. The palettes have fixed
+ * unique ids, so the server sends each one only once to a client.
+ */
+static gboolean palette_glyphs;
+static QXLPalette *glyph_palettes[256]; // index fg * 16 + bg
+static QXLPalette *text_palette;
+static uint8_t *uline_font_data; // vt_font_data with the underline row set
+static uint32_t nibble_mask[256]; // font row -> 4BIT_BE pixel mask (memory order)
+
+static QXLPalette *palette_new(uint64_t unique, int num_ents) {
+    QXLPalette *palette = g_malloc0(sizeof(QXLPalette) + num_ents * sizeof(uint32_t));
+
+    palette->unique = unique;
+    palette->num_ents = num_ents;
+
+    return palette;
+}
+
+static void palette_glyphs_init(void) {
+    int fg, bg, i, j;
+
+    text_palette = palette_new(1, 16);
+    for (i = 0; i < 16; i++) {
+        text_palette->ents[i] = color_to_rgb(i);
+    }
 
-    if (!uline && c < 256) {
-        cache_id = ((fg << 12) | (bg << 8) | (c & 255)) & 0x0ffff;
-        if ((ce = (CachedImage *)g_hash_table_lookup(spice_screen->image_cache, &cache_id))) {
-            bitmap = ce->bitmap;
+    for (fg = 0; fg < 16; fg++) {
+        for (bg = 0; bg < 16; bg++) {
+            QXLPalette *palette = palette_new(2 + fg * 16 + bg, 2);
+            palette->ents[0] = color_to_rgb(bg);
+            palette->ents[1] = color_to_rgb(fg);
+            glyph_palettes[fg * 16 + bg] = palette;
         }
     }
 
-    int bw = 8, bh = 16;
-    int left = x * bw, top = y * bh;
+    uline_font_data = g_malloc(sizeof(vt_font_data));
+    memcpy(uline_font_data, vt_font_data, sizeof(vt_font_data));
+    for (i = 14; i < sizeof(vt_font_data); i += 16) {
+        uline_font_data[i] = 0xff;
+    }
+
+    for (i = 0; i < 256; i++) {
+        uint8_t mask[4];
+        for (j = 0; j < 4; j++) {
+            mask[j] = ((i & (0x80 >> (2 * j))) ? 0xf0 : 0) | ((i & (0x40 >> (2 * j))) ? 0x0f : 0);
+        }
+        memcpy(&nibble_mask[i], mask, 4);
+    }
+
+    palette_glyphs = TRUE;
+}
+
+static const uint8_t *glyph_rows(int c, gboolean uline) {
+    return (uline ? uline_font_data : vt_font_data) + c * 16;
+}
+
+/* 4 bits per pixel, the left pixel in the high nibble */
+static void render_glyph_4bit(uint8_t *dst, int stride, const uint8_t *rows, int fg, int bg) {
+    uint32_t fgv = fg * 0x11111111u;
+    uint32_t bgv = bg * 0x11111111u;
+
+    for (int j = 0; j < 16; j++) {
+        uint32_t mask = nibble_mask[rows[j]];
+        uint32_t v = (fgv & mask) | (bgv & ~mask);
+        memcpy(dst + j * stride, &v, 4);
+    }
+}
+
+/* Image cache: a LRU list (most recently used first) on top of the hash
+ * table. Entries are refcounted, so evicting an entry never frees a bitmap
+ * still used by a queued command. Image ids are derived from the content,
+ * so an evicted and re-rendered entry gets the same id and pixels, which
+ * keeps us consistent with whatever the client still has cached.
+ */
+
+static void image_cache_evict(SpiceScreen *spice_screen, CachedImage *ce) {
+    g_hash_table_remove(spice_screen->image_cache, &ce->cache_id);
+    g_queue_unlink(&spice_screen->image_cache_lru, &ce->lru_link);
+    spice_screen->image_cache_bytes -= ce->size;
+    spice_screen->image_cache_evictions++;
+
+    cached_image_unref(ce);
+}
+
+static CachedImage *image_cache_lookup(SpiceScreen *spice_screen, uint64_t cache_id) {
+    CachedImage *ce = g_hash_table_lookup(spice_screen->image_cache, &cache_id);
+
+    if (!ce) {
+        spice_screen->image_cache_misses++;
+        return NULL;
+    }
+
+    spice_screen->image_cache_hits++;
+
+    g_queue_unlink(&spice_screen->image_cache_lru, &ce->lru_link);
+    g_queue_push_head_link(&spice_screen->image_cache_lru, &ce->lru_link);
+
+    return ce;
+}
+
+/* takes ownership of bitmap (g_malloc) */
+static CachedImage *image_cache_insert(
+    SpiceScreen *spice_screen, uint64_t cache_id, uint8_t *bitmap, gsize bitmap_size
+) {
+    CachedImage *ce = g_new0(CachedImage, 1);
+
+    ce->cache_id = cache_id;
+    ce->bitmap = bitmap;
+    ce->size = sizeof(CachedImage) + bitmap_size;
+    ce->refcount = 1; /* reference held by the cache */
+    ce->lru_link.data = ce;
+
+    g_hash_table_insert(spice_screen->image_cache, &ce->cache_id, ce);
+    g_queue_push_head_link(&spice_screen->image_cache_lru, &ce->lru_link);
+    spice_screen->image_cache_bytes += ce->size;
+
+    while (spice_screen->image_cache_lru.length > IMAGE_CACHE_MAX_ENTRIES ||
+           spice_screen->image_cache_bytes > spice_screen->image_cache_max_bytes) {
+        GList *link = g_queue_peek_tail_link(&spice_screen->image_cache_lru);
+        if (link == &ce->lru_link) {
+            break; /* always keep the new entry */
+        }
+        image_cache_evict(spice_screen, link->data);
+    }
+
+    DPRINTF(
+        2, "%u entries, %zu bytes, %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT
+           " misses, %" G_GUINT64_FORMAT " evictions",
+        spice_screen->image_cache_lru.length, spice_screen->image_cache_bytes,
+        spice_screen->image_cache_hits, spice_screen->image_cache_misses,
+        spice_screen->image_cache_evictions
+    );
+
+    return ce;
+}
+
+/* Glyph atlas: an optional file with the prerendered bitmaps of the first
+ * GLYPH_ATLAS_GLYPHS glyphs (without underline) for all fg/bg pairs. It is
+ * mapped read-only, so all spiceterm processes share one copy via the page
+ * cache. Layout: header page, then the glyph bitmaps at
+ * ((fg * 16 + bg) * GLYPH_ATLAS_GLYPHS + glyph) * GLYPH_SIZE.
+ */
+
+#define GLYPH_SIZE (8 * 16 * 4)
+#define GLYPH_ATLAS_MAGIC "spiceterm-atlas"
+#define GLYPH_ATLAS_VERSION 1
+#define GLYPH_ATLAS_GLYPHS 256
+#define GLYPH_ATLAS_HEADER_SIZE 4096
+#define GLYPH_ATLAS_SIZE (GLYPH_ATLAS_HEADER_SIZE + 16 * 16 * GLYPH_ATLAS_GLYPHS * GLYPH_SIZE)
+
+typedef struct GlyphAtlasHeader {
+    char magic[16];
+    uint32_t version;
+    uint32_t glyphs;
+    uint64_t hash; // font and colours the atlas was rendered from
+} GlyphAtlasHeader;
+
+static uint8_t *glyph_atlas;
+
+static uint64_t fnv1a_hash(uint64_t hash, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    while (len--) {
+        hash = (hash ^ *p++) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static void glyph_atlas_header(GlyphAtlasHeader *header) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    hash = fnv1a_hash(hash, vt_font_data, GLYPH_ATLAS_GLYPHS * 16);
+    hash = fnv1a_hash(hash, default_red, sizeof(default_red));
+    hash = fnv1a_hash(hash, default_grn, sizeof(default_grn));
+    hash = fnv1a_hash(hash, default_blu, sizeof(default_blu));
+    hash = fnv1a_hash(hash, color_table, 16);
+
+    memset(header, 0, sizeof(*header));
+    strcpy(header->magic, GLYPH_ATLAS_MAGIC);
+    header->version = GLYPH_ATLAS_VERSION;
+    header->glyphs = GLYPH_ATLAS_GLYPHS;
+    header->hash = hash;
+}
+
+/* on failure, *error tells why (a static string) */
+static gboolean glyph_atlas_map(const char *path, const char **error) {
+    GlyphAtlasHeader header;
+    struct stat st;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        *error = strerror(errno);
+        return FALSE;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        *error = strerror(errno);
+        close(fd);
+        return FALSE;
+    }
+
+    if (st.st_size != GLYPH_ATLAS_SIZE) {
+        *error = "unexpected atlas size";
+        close(fd);
+        return FALSE;
+    }
+
+    void *atlas = mmap(NULL, GLYPH_ATLAS_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (atlas == MAP_FAILED) {
+        *error = strerror(errno);
+        close(fd);
+        return FALSE;
+    }
+    close(fd);
 
-    if (!bitmap) {
-        uint8_t *dst = bitmap = g_malloc(bw * bh * 4);
-
-        unsigned char *data = vt_font_data + c * 16;
-        unsigned char d = *data;
-
-        g_assert(fg >= 0 && fg < 16);
-        g_assert(bg >= 0 && bg < 16);
-
-        unsigned char fgc_red = default_red[color_table[fg]];
-        unsigned char fgc_blue = default_blu[color_table[fg]];
-        unsigned char fgc_green = default_grn[color_table[fg]];
-        unsigned char bgc_red = default_red[color_table[bg]];
-        unsigned char bgc_blue = default_blu[color_table[bg]];
-        unsigned char bgc_green = default_grn[color_table[bg]];
-
-        for (int j = 0; j < 16; j++) {
-            gboolean ul = (j == 14) && uline;
-            for (int i = 0; i < 8; i++) {
-                if (i == 0) {
-                    d = *data;
-                    data++;
-                }
-                if (ul || d & 0x80) {
-                    *(dst + 0) = fgc_blue;
-                    *(dst + 1) = fgc_green;
-                    *(dst + 2) = fgc_red;
-                    *(dst + 3) = 0;
-                } else {
-                    *(dst + 0) = bgc_blue;
-                    *(dst + 1) = bgc_green;
-                    *(dst + 2) = bgc_red;
-                    *(dst + 3) = 0;
-                }
-                d <<= 1;
-                dst += 4;
+    glyph_atlas_header(&header);
+    if (memcmp(atlas, &header, sizeof(header)) != 0) {
+        *error = "incompatible atlas header";
+        munmap(atlas, GLYPH_ATLAS_SIZE);
+        return FALSE;
+    }
+
+    glyph_atlas = atlas;
+
+    return TRUE;
+}
+
+static gboolean write_all(int fd, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    while (len > 0) {
+        ssize_t res = write(fd, p, len);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            return FALSE;
         }
+        p += res;
+        len -= res;
+    }
+
+    return TRUE;
+}
+
+/* written to a temporary file first, so concurrent processes never see a
+ * partial atlas */
+static gboolean glyph_atlas_create(const char *path, const char **error) {
+    uint8_t page[GLYPH_ATLAS_HEADER_SIZE] = {0};
+    gboolean res = FALSE;
+
+    char *tmpname = g_strdup_printf("%s.XXXXXX", path);
+    int fd = mkstemp(tmpname);
+    if (fd < 0) {
+        *error = strerror(errno);
+        g_free(tmpname);
+        return FALSE;
+    }
+
+    uint8_t *bitmaps = g_malloc(GLYPH_ATLAS_GLYPHS * GLYPH_SIZE);
 
-        if (cache_id != 0) {
-            ce = g_new(CachedImage, 1);
-            ce->cache_id = cache_id;
-            ce->bitmap = bitmap;
-            g_hash_table_insert(spice_screen->image_cache, &ce->cache_id, ce);
+    glyph_atlas_header((GlyphAtlasHeader *)page);
+    if (!write_all(fd, page, sizeof(page))) {
+        goto out;
+    }
+
+    for (int fg = 0; fg < 16; fg++) {
+        for (int bg = 0; bg < 16; bg++) {
+            for (int c = 0; c < GLYPH_ATLAS_GLYPHS; c++) {
+                render_glyph(bitmaps + c * GLYPH_SIZE, 8 * 4, c, fg, bg, FALSE);
+            }
+            if (!write_all(fd, bitmaps, GLYPH_ATLAS_GLYPHS * GLYPH_SIZE)) {
+                goto out;
+            }
         }
     }
 
+    res = fchmod(fd, 0644) == 0 && rename(tmpname, path) == 0;
+
+out:
+    if (!res) {
+        *error = strerror(errno);
+    }
+    close(fd);
+    if (!res) {
+        unlink(tmpname);
+    }
+    g_free(bitmaps);
+    g_free(tmpname);
+
+    return res;
+}
+
+/* generates the atlas file if it is missing or does not match our font */
+static void glyph_atlas_init(const char *path) {
+    const char *error;
+
+    if (glyph_atlas_map(path, &error)) {
+        return;
+    }
+
+    if (!glyph_atlas_create(path, &error) || !glyph_atlas_map(path, &error)) {
+        fprintf(stderr, "unable to use glyph atlas '%s' - %s\n", path, error);
+        return;
+    }
+
+    DPRINTF(1, "created glyph atlas '%s'", path);
+}
+
+static SimpleSpiceUpdate *spice_screen_draw_char_cmd(
+    SpiceScreen *spice_screen, int x, int y, int c, int fg, int bg, gboolean uline
+) {
+    SimpleSpiceUpdate *update;
+    QXLRect bbox;
+    uint64_t cache_id = IMAGE_ID_GLYPH | glyph_cache_key(c, fg, bg, uline);
+    CachedImage *ce;
+
+    int bw = 8, bh = 16;
+    int left = x * bw, top = y * bh;
+
     bbox.left = left;
     bbox.top = top;
     bbox.right = left + bw;
     bbox.bottom = top + bh;
 
-    return spice_screen_update_from_bitmap_cmd(0, bbox, bitmap, cache_id);
+    if (palette_glyphs) {
+        return spice_screen_update_from_palette_bitmap_cmd(
+            0, bbox, (uint8_t *)glyph_rows(c, uline), cache_id, SPICE_BITMAP_FMT_1BIT_BE, 1,
+            glyph_palettes[fg * 16 + bg]
+        );
+    }
+
+    if (glyph_atlas && c < GLYPH_ATLAS_GLYPHS && !uline) {
+        uint8_t *bitmap = glyph_atlas + GLYPH_ATLAS_HEADER_SIZE +
+                          ((fg * 16 + bg) * GLYPH_ATLAS_GLYPHS + c) * GLYPH_SIZE;
+        return spice_screen_update_from_bitmap_cmd(0, bbox, bitmap, cache_id);
+    }
+
+    if (!(ce = image_cache_lookup(spice_screen, cache_id))) {
+        uint8_t *bitmap = g_malloc(bw * bh * 4);
+
+        render_glyph(bitmap, bw * 4, c, fg, bg, uline);
+
+        ce = image_cache_insert(spice_screen, cache_id, bitmap, bw * bh * 4);
+    }
+
+    update = spice_screen_update_from_bitmap_cmd(0, bbox, ce->bitmap, cache_id);
+    g_atomic_int_inc(&ce->refcount);
+    update->cached = ce;
+
+    return update;
 }
 
-void spice_screen_scroll(
+static void text_attributes_to_colors(TextAttributes attrib, int *fg, int *bg) {
+    if (attrib.invers) {
+        *bg = attrib.fgcol;
+        *fg = attrib.bgcol;
+    } else {
+        *bg = attrib.bgcol;
+        *fg = attrib.fgcol;
+    }
+
+    if (attrib.bold) {
+        *fg += 8;
+    }
+
+    // unsuported attributes = (attrib.blink || attrib.unvisible)
+}
+
+/* Shadow grid: what each cell of the primary surface shows right now, as a
+ * glyph_cache_key (SHADOW_INVALID if unknown). Every drawing function keeps
+ * it up to date, so spice_screen_draw_text() can skip cells the client
+ * already has - a refresh then only costs the cells which really changed.
+ */
+#define SHADOW_INVALID 0xffffffffu
+#define SHADOW_INVERTED (1u << 31) // cell is covered by an inverted overlay
+#define SHADOW_MIN_GAP 4 // split a span at that many unchanged cells
+
+static uint32_t shadow_key(int c, int fg, int bg, gboolean uline) {
+    if (!uline) {
+        uint64_t rows[2];
+        memcpy(rows, vt_font_data + c * 16, 16);
+        if (!(rows[0] | rows[1])) {
+            fg = bg; // blank glyph, same pixels as a fill
+        }
+    }
+    return glyph_cache_key(c, fg, bg, uline);
+}
+
+static uint32_t shadow_cell_key(TextCell *cell) {
+    int fg, bg;
+    text_attributes_to_colors(cell->attrib, &fg, &bg);
+    return shadow_key(vt_fontmap[cell->ch], fg, bg, cell->attrib.uline);
+}
+
+static void shadow_reset(SpiceScreen *spice_screen) {
+    spice_screen->shadow_cols = spice_screen->primary_width / 8;
+    spice_screen->shadow_rows = spice_screen->primary_height / 16;
+
+    int cells = spice_screen->shadow_cols * spice_screen->shadow_rows;
+    spice_screen->shadow = g_renew(uint32_t, spice_screen->shadow, cells);
+    for (int i = 0; i < cells; i++) {
+        spice_screen->shadow[i] = SHADOW_INVALID;
+    }
+}
+
+/* set all cells touched by the pixel rectangle; partially covered cells get
+ * SHADOW_INVALID */
+static void shadow_fill(SpiceScreen *spice_screen, int x1, int y1, int x2, int y2, uint32_t key) {
+    int cx1 = MAX(x1 / 8, 0), cx2 = MIN((x2 + 7) / 8, spice_screen->shadow_cols);
+    int cy1 = MAX(y1 / 16, 0), cy2 = MIN((y2 + 15) / 16, spice_screen->shadow_rows);
+
+    for (int cy = cy1; cy < cy2; cy++) {
+        gboolean partial_y = cy * 16 < y1 || (cy + 1) * 16 > y2;
+        uint32_t *row = spice_screen->shadow + cy * spice_screen->shadow_cols;
+        for (int cx = cx1; cx < cx2; cx++) {
+            gboolean partial = partial_y || cx * 8 < x1 || (cx + 1) * 8 > x2;
+            row[cx] = partial ? SHADOW_INVALID : key;
+        }
+    }
+}
+
+static void shadow_invert(SpiceScreen *spice_screen, int x1, int y1, int x2, int y2) {
+    int cx1 = MAX(x1 / 8, 0), cx2 = MIN((x2 + 7) / 8, spice_screen->shadow_cols);
+    int cy1 = MAX(y1 / 16, 0), cy2 = MIN((y2 + 15) / 16, spice_screen->shadow_rows);
+
+    for (int cy = cy1; cy < cy2; cy++) {
+        gboolean partial_y = cy * 16 < y1 || (cy + 1) * 16 > y2;
+        uint32_t *row = spice_screen->shadow + cy * spice_screen->shadow_cols;
+        for (int cx = cx1; cx < cx2; cx++) {
+            if (partial_y || cx * 8 < x1 || (cx + 1) * 8 > x2) {
+                row[cx] = SHADOW_INVALID;
+            } else if (row[cx] != SHADOW_INVALID) {
+                row[cx] ^= SHADOW_INVERTED;
+            }
+        }
+    }
+}
+
+/* follow a COPY_BITS of the pixel rectangle from (src_x, src_y) */
+static void
+shadow_copy(SpiceScreen *spice_screen, int x1, int y1, int x2, int y2, int src_x, int src_y) {
+    int cols = spice_screen->shadow_cols, rows = spice_screen->shadow_rows;
+
+    if ((x1 | y1 | x2 | y2 | src_x | src_y) < 0 || x1 % 8 || x2 % 8 || src_x % 8 || y1 % 16 ||
+        y2 % 16 || src_y % 16) {
+        shadow_fill(spice_screen, x1, y1, x2, y2, SHADOW_INVALID);
+        return;
+    }
+
+    int cx1 = x1 / 8, cy1 = y1 / 16, cx2 = MIN(x2 / 8, cols), cy2 = MIN(y2 / 16, rows);
+    int dx = src_x / 8 - cx1, dy = src_y / 16 - cy1;
+
+    if (cx1 >= cx2 || cy1 >= cy2) {
+        return;
+    }
+
+    // walk rows away from the source so nothing is overwritten before it is copied
+    for (int i = 0; i < cy2 - cy1; i++) {
+        int cy = dy > 0 ? cy1 + i : cy2 - 1 - i;
+        uint32_t *dst = spice_screen->shadow + cy * cols;
+        int sy = cy + dy;
+        for (int cx = cx1; cx < cx2; cx++) {
+            if (sy >= rows || cx + dx >= cols) {
+                dst[cx] = SHADOW_INVALID;
+            }
+        }
+        if (sy < rows) {
+            int n = MIN(cx2, cols - dx) - cx1;
+            if (n > 0) {
+                memmove(dst + cx1, spice_screen->shadow + sy * cols + cx1 + dx, n * 4);
+            }
+        }
+    }
+}
+
+gboolean spice_screen_scroll(
     SpiceScreen *spice_screen, int x1, int y1, int x2, int y2, int src_x, int src_y
 ) {
     SimpleSpiceUpdate *update;
@@ -301,7 +889,11 @@ void spice_screen_scroll(
 
     int surface_id = 0;
 
-    update = g_new0(SimpleSpiceUpdate, 1);
+    if (command_ring_full(spice_screen)) {
+        return FALSE;
+    }
+
+    update = pool_alloc0(&update_pool);
     drawable = &update->drawable;
 
     bbox.left = x1;
@@ -326,16 +918,30 @@ void spice_screen_scroll(
     set_cmd(&update->ext, QXL_CMD_DRAW, (intptr_t)drawable);
 
     push_command(spice_screen, &update->ext);
+
+    shadow_copy(spice_screen, x1, y1, x2, y2, src_x, src_y);
+
+    return TRUE;
 }
 
-void spice_screen_clear(SpiceScreen *spice_screen, int x1, int y1, int x2, int y2) {
+/* fill the area with the background colour of 'attrib' (i.e. blank cells) */
+gboolean spice_screen_clear(
+    SpiceScreen *spice_screen, int x1, int y1, int x2, int y2, TextAttributes attrib
+) {
     SimpleSpiceUpdate *update;
     QXLDrawable *drawable;
     QXLRect bbox;
+    int fg, bg;
 
     int surface_id = 0;
 
-    update = g_new0(SimpleSpiceUpdate, 1);
+    text_attributes_to_colors(attrib, &fg, &bg);
+
+    if (command_ring_full(spice_screen)) {
+        return FALSE;
+    }
+
+    update = pool_alloc0(&update_pool);
     drawable = &update->drawable;
 
     bbox.left = x1;
@@ -349,7 +955,52 @@ void spice_screen_clear(SpiceScreen *spice_screen, int x1, int y1, int x2, int y
     drawable->clip.type = SPICE_CLIP_TYPE_NONE;
     drawable->effect = QXL_EFFECT_OPAQUE;
     simple_set_release_info(&drawable->release_info, (intptr_t)update);
-    drawable->type = QXL_DRAW_BLACKNESS;
+    drawable->type = QXL_DRAW_FILL;
+    drawable->surfaces_dest[0] = -1;
+    drawable->surfaces_dest[1] = -1;
+    drawable->surfaces_dest[2] = -1;
+
+    drawable->u.fill.brush.type = SPICE_BRUSH_TYPE_SOLID;
+    drawable->u.fill.brush.u.color = color_to_rgb(bg);
+    drawable->u.fill.rop_descriptor = SPICE_ROPD_OP_PUT;
+
+    set_cmd(&update->ext, QXL_CMD_DRAW, (intptr_t)drawable);
+
+    push_command(spice_screen, &update->ext);
+
+    shadow_fill(spice_screen, x1, y1, x2, y2, shadow_key(vt_fontmap[' '], fg, bg, FALSE));
+
+    return TRUE;
+}
+
+/* invert all pixels of the area; doing it twice restores them */
+gboolean spice_screen_invert(SpiceScreen *spice_screen, int x1, int y1, int x2, int y2) {
+    SimpleSpiceUpdate *update;
+    QXLDrawable *drawable;
+    QXLRect bbox;
+
+    int surface_id = 0;
+
+    if (command_ring_full(spice_screen)) {
+        return FALSE;
+    }
+
+    update = pool_alloc0(&update_pool);
+    drawable = &update->drawable;
+
+    bbox.left = x1;
+    bbox.top = y1;
+    bbox.right = x2;
+    bbox.bottom = y2;
+
+    drawable->surface_id = surface_id;
+
+    drawable->bbox = bbox;
+    drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+    // reads the destination, so queued draws below it must not be dropped
+    drawable->effect = QXL_EFFECT_REVERT_ON_DUP;
+    simple_set_release_info(&drawable->release_info, (intptr_t)update);
+    drawable->type = QXL_DRAW_INVERS;
     drawable->surfaces_dest[0] = -1;
     drawable->surfaces_dest[1] = -1;
     drawable->surfaces_dest[2] = -1;
@@ -357,6 +1008,10 @@ void spice_screen_clear(SpiceScreen *spice_screen, int x1, int y1, int x2, int y
     set_cmd(&update->ext, QXL_CMD_DRAW, (intptr_t)drawable);
 
     push_command(spice_screen, &update->ext);
+
+    shadow_invert(spice_screen, x1, y1, x2, y2);
+
+    return TRUE;
 }
 
 static void create_primary_surface(SpiceScreen *spice_screen, uint32_t width, uint32_t height) {
@@ -375,6 +1030,10 @@ static void create_primary_surface(SpiceScreen *spice_screen, uint32_t width, ui
         width = MAX_WIDTH;
     }
 
+    /* the old surface (if any) is destroyed, so its memory is unused */
+    g_free(spice_screen->primary_surface);
+    spice_screen->primary_surface = g_malloc0(width * height * 4);
+
     // clang-format off
     surface.format     = SPICE_SURFACE_FMT_32_xRGB;
     surface.width      = spice_screen->primary_width      = width;
@@ -384,7 +1043,7 @@ static void create_primary_surface(SpiceScreen *spice_screen, uint32_t width, ui
     surface.flags      = 0;
     surface.type       = 0;    /* unused by red_worker */
     surface.position   = 0;    /* unused by red_worker */
-    surface.mem        = (uint64_t)&spice_screen->primary_surface;
+    surface.mem        = (uint64_t)spice_screen->primary_surface;
     surface.group_id   = MEM_SLOT_GROUP_ID;
     // clang-format on
 
@@ -393,6 +1052,8 @@ static void create_primary_surface(SpiceScreen *spice_screen, uint32_t width, ui
 
     spice_screen->cursor_set = 0;
 
+    shadow_reset(spice_screen);
+
     spice_qxl_create_primary_surface(&spice_screen->qxl_instance, 0, &surface);
 }
 
@@ -429,49 +1090,66 @@ static void get_init_info(QXLInstance *qin, QXLDevInitInfo *info) {
     info->num_memslots_groups = 1;
     info->memslot_id_bits = 1;
     info->memslot_gen_bits = 1;
-    info->n_surfaces = 1;
+    info->n_surfaces = 1 + SCREEN_PAGES;
 }
 
 /* called from spice_server thread (i.e. red_worker thread) */
 static int get_command(QXLInstance *qin, struct QXLCommandExt *ext) {
     SpiceScreen *spice_screen = SPICE_CONTAINEROF(qin, SpiceScreen, qxl_instance);
-    int res = FALSE;
+    QXLCommandExt *cmd = NULL;
+    unsigned int start, pos, end;
+
+    start = atomic_load_explicit(&spice_screen->commands_start, memory_order_relaxed);
+    end = atomic_load_explicit(&spice_screen->commands_end, memory_order_acquire);
 
-    g_mutex_lock(&spice_screen->command_mutex);
+    /* superseded commands leave a NULL slot */
+    for (pos = start; pos != end && !cmd; pos++) {
+        cmd = atomic_exchange_explicit(
+            &spice_screen->commands[pos % COMMANDS_SIZE], NULL, memory_order_acquire
+        );
+    }
 
-    if ((spice_screen->commands_end - spice_screen->commands_start) == 0) {
-        res = FALSE;
-        goto ret;
+    if (pos != start) {
+        atomic_store_explicit(&spice_screen->commands_start, pos, memory_order_release);
     }
 
-    *ext = *spice_screen->commands[spice_screen->commands_start % COMMANDS_SIZE];
-    g_assert(spice_screen->commands_start < spice_screen->commands_end);
-    spice_screen->commands_start++;
-    g_cond_signal(&spice_screen->command_cond);
+    if (!cmd) {
+        return FALSE;
+    }
 
-    res = TRUE;
+    *ext = *cmd;
 
-ret:
-    g_mutex_unlock(&spice_screen->command_mutex);
-    return res;
+    return TRUE;
 }
 
+/* called from the main thread, may run concurrently with get_command() */
 void discard_pending_commands(SpiceScreen *spice_screen) {
-    int pos;
+    unsigned int pos, start, end;
+
+    end = atomic_load_explicit(&spice_screen->commands_end, memory_order_relaxed);
+    start = atomic_load_explicit(&spice_screen->commands_start, memory_order_acquire);
 
-    g_mutex_lock(&spice_screen->command_mutex);
-    for (pos = spice_screen->commands_start; pos < spice_screen->commands_end; pos++) {
-        release_qxl_command_ext(spice_screen->commands[pos % COMMANDS_SIZE]);
+    for (pos = start; pos != end; pos++) {
+        QXLCommandExt *ext = atomic_exchange_explicit(
+            &spice_screen->commands[pos % COMMANDS_SIZE], NULL, memory_order_acquire
+        );
+        if (ext) {
+            release_qxl_command_ext(ext);
+        }
     }
-    spice_screen->commands_start = spice_screen->commands_end;
-    g_mutex_unlock(&spice_screen->command_mutex);
 }
 
 static int req_cmd_notification(QXLInstance *qin) {
-    // SpiceScreen *spice_screen = SPICE_CONTAINEROF(qin, SpiceScreen, qxl_instance);
-    // spice_screen->core->timer_start(spice_screen->wakeup_timer, spice_screen->wakeup_ms);
+    SpiceScreen *spice_screen = SPICE_CONTAINEROF(qin, SpiceScreen, qxl_instance);
 
-    return TRUE;
+    /* The worker sleeps until the next wakeup if we return TRUE. push_command()
+     * only wakes it on the empty to non-empty transition, so recheck the
+     * ring after a full fence (pairs with the fence in push_command()).
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+
+    return atomic_load_explicit(&spice_screen->commands_end, memory_order_relaxed) ==
+           atomic_load_explicit(&spice_screen->commands_start, memory_order_relaxed);
 }
 
 #define CURSOR_WIDTH 8
@@ -513,8 +1191,9 @@ static int get_cursor_command(QXLInstance *qin, struct QXLCommandExt *ext) {
 
     spice_screen->cursor_set = 1;
 
-    cmd = calloc(sizeof(QXLCommandExt), 1);
-    cursor_cmd = calloc(sizeof(QXLCursorCmd), 1);
+    SimpleSpiceCursor *simple_cursor = pool_alloc0(&cursor_pool);
+    cmd = &simple_cursor->ext;
+    cursor_cmd = &simple_cursor->cmd;
 
     cursor_cmd->release_info.id = (unsigned long)cmd;
 
@@ -574,14 +1253,133 @@ static void client_connected(SpiceScreen *spice_screen) {
     DPRINTF(1, "client_count = %d", spice_screen->client_count);
 }
 
+static void log_pool_stats(Pool *pool) {
+    PoolStats stats;
+
+    pool_get_stats(pool, &stats);
+
+    DPRINTF(
+        1, "%s pool: %u slabs, %u objects, %u in use, %" G_GUINT64_FORMAT " allocs", pool->name,
+        stats.slabs, stats.objects, stats.in_use, stats.allocs
+    );
+}
+
 static void client_disconnected(SpiceScreen *spice_screen) {
     if (spice_screen->client_count > 0) {
         spice_screen->client_count--;
         DPRINTF(1, "client_count = %d", spice_screen->client_count);
+        log_pool_stats(&update_pool);
+        log_pool_stats(&cursor_pool);
         exit(0); // fixme: cleanup?
     }
 }
 
+/* Adaptive image compression: a command ring that keeps filling means the
+ * worker does not keep up. If the client link is the bottleneck (the worker
+ * stops taking commands while it is backed up), GLZ (better ratio, more CPU)
+ * pays off and the ring drains faster with it. If the worker is CPU bound,
+ * GLZ makes it drain slower. So switch to GLZ under pressure, but keep it
+ * only while it drains more commands per sample than LZ did before the
+ * switch; otherwise go back to LZ and do not try again for a while.
+ * Switch back to LZ only after the ring stayed nearly empty for a while,
+ * so we do not flap between both.
+ */
+#define COMPRESSION_SAMPLE_INTERVAL 1000 // ms
+#define COMPRESSION_RELAX_SAMPLES 10
+#define COMPRESSION_HOLD_SAMPLES 30 // LZ after GLZ did not help
+
+static void set_image_compression(SpiceScreen *spice_screen, int compression) {
+    if (spice_screen->image_compression == compression) {
+        return;
+    }
+
+    DPRINTF(
+        1, "image compression %s", compression == SPICE_IMAGE_COMPRESSION_GLZ ? "GLZ" : "LZ"
+    );
+
+    spice_screen->image_compression = compression;
+    spice_server_set_image_compression(spice_screen->server, compression);
+}
+
+static void compression_sample(void *opaque) {
+    SpiceScreen *spice_screen = opaque;
+
+    unsigned int start = atomic_load_explicit(&spice_screen->commands_start, memory_order_relaxed);
+    unsigned int end = atomic_load_explicit(&spice_screen->commands_end, memory_order_relaxed);
+    unsigned int drained = start - spice_screen->compression_last_start;
+    unsigned int backlog = end - start;
+    guint full = spice_screen->ring_full_count;
+
+    spice_screen->compression_last_start = start;
+    spice_screen->ring_full_count = 0;
+
+    DPRINTF(
+        2, "drained %u commands/s, backlog %u, ring full %u times",
+        drained * 1000 / COMPRESSION_SAMPLE_INTERVAL, backlog, full
+    );
+
+    if (full || backlog >= COMMANDS_SIZE / 2) {
+        spice_screen->compression_relaxed_samples = 0;
+        if (spice_screen->image_compression != SPICE_IMAGE_COMPRESSION_GLZ) {
+            if (spice_screen->compression_hold_samples) {
+                spice_screen->compression_hold_samples--;
+            } else {
+                spice_screen->compression_lz_drained = drained;
+                set_image_compression(spice_screen, SPICE_IMAGE_COMPRESSION_GLZ);
+            }
+        } else if (drained < spice_screen->compression_lz_drained) {
+            /* GLZ drains slower: the worker, not the link, is the bottleneck */
+            spice_screen->compression_hold_samples = COMPRESSION_HOLD_SAMPLES;
+            set_image_compression(spice_screen, SPICE_IMAGE_COMPRESSION_LZ);
+        }
+    } else if (backlog < COMMANDS_SIZE / 16 &&
+               ++spice_screen->compression_relaxed_samples >= COMPRESSION_RELAX_SAMPLES) {
+        set_image_compression(spice_screen, SPICE_IMAGE_COMPRESSION_LZ);
+    }
+
+    spice_screen->core->timer_start(spice_screen->compression_timer, COMPRESSION_SAMPLE_INTERVAL);
+}
+
+static void compression_init(SpiceScreen *spice_screen, SpiceTermOptions *opts) {
+    SpiceServer *server = spice_screen->server;
+
+    if (opts->adaptive_compression) {
+        spice_screen->image_compression = SPICE_IMAGE_COMPRESSION_LZ;
+        spice_server_set_image_compression(server, spice_screen->image_compression);
+    } else if (opts->image_compression) {
+        spice_server_set_image_compression(server, opts->image_compression);
+    }
+
+    if (opts->jpeg_compression) {
+        spice_server_set_jpeg_compression(server, opts->jpeg_compression);
+    }
+    if (opts->zlib_glz_compression) {
+        spice_server_set_zlib_glz_compression(server, opts->zlib_glz_compression);
+    }
+    if (opts->streaming_video) {
+        spice_server_set_streaming_video(server, opts->streaming_video);
+    }
+}
+
+static void compression_start(SpiceScreen *spice_screen, SpiceTermOptions *opts) {
+    if (!opts->adaptive_compression) {
+        return;
+    }
+
+    spice_screen->compression_timer =
+        spice_screen->core->timer_add(compression_sample, spice_screen);
+    spice_screen->core->timer_start(spice_screen->compression_timer, COMPRESSION_SAMPLE_INTERVAL);
+}
+
+/* commands queued but not yet taken by the worker, which stops taking them
+ * while the client connection is backed up */
+guint spice_screen_backlog(SpiceScreen *spice_screen) {
+    unsigned int start = atomic_load_explicit(&spice_screen->commands_start, memory_order_relaxed);
+    unsigned int end = atomic_load_explicit(&spice_screen->commands_end, memory_order_relaxed);
+
+    return end - start;
+}
+
 static void do_conn_timeout(void *opaque) {
     SpiceScreen *spice_screen = opaque;
 
@@ -614,43 +1412,432 @@ QXLInterface display_sif = {
     .set_client_capabilities = set_client_capabilities,
 };
 
-void spice_screen_draw_char(
-    SpiceScreen *spice_screen, int x, int y, gunichar2 ch, TextAttributes attrib
-) {
-    int fg, bg;
+/* Spans get an image id derived from their cells (shadow keys), so the
+ * same text anywhere on the screen maps to the same client cache entry -
+ * think of `watch` or `top` redrawing identical rows. Only spans seen
+ * before are cached, one-off text would just evict glyphs from the client
+ * cache. Returns 0 for "do not cache".
+ */
+static uint64_t span_cache_id(SpiceScreen *spice_screen, const uint32_t *keys, int count) {
+    uint64_t hash = fnv1a_hash(0xcbf29ce484222325ULL, keys, count * sizeof(uint32_t));
+    uint64_t id = IMAGE_ID_SPAN | (hash & (IMAGE_ID_SPAN - 1));
+    uint64_t *seen = &spice_screen->span_seen[hash % SPAN_SEEN_SIZE];
+
+    if (*seen == id) {
+        return id;
+    }
+    *seen = id;
 
-    int invers;
-    if (attrib.invers) {
-        invers = attrib.selected ? 0 : 1;
-    } else {
-        invers = attrib.selected ? 1 : 0;
+    return 0;
+}
+
+/* render a run of cells on one row, 'stride' is in bytes */
+static void render_cells(uint8_t *dst, int stride, const TextCell *cells, int count) {
+    for (int i = 0; i < count; i++) {
+        int fg, bg;
+        text_attributes_to_colors(cells[i].attrib, &fg, &bg);
+        int c = vt_fontmap[cells[i].ch];
+        if (palette_glyphs) {
+            render_glyph_4bit(dst + i * 4, stride, glyph_rows(c, cells[i].attrib.uline), fg, bg);
+        } else {
+            render_glyph(dst + i * 8 * 4, stride, c, fg, bg, cells[i].attrib.uline);
+        }
     }
+}
+
+/* bytes per pixel row of a bitmap holding 'cols' cells */
+static int cells_stride(int cols) { return palette_glyphs ? cols * 4 : cols * 8 * 4; }
+
+/* a drawable for a bitmap filled by render_cells, freed on release */
+static SimpleSpiceUpdate *cells_bitmap_update(QXLRect bbox, uint8_t *bitmap, uint64_t cache_id) {
+    SimpleSpiceUpdate *update;
 
-    if (invers) {
-        bg = attrib.fgcol;
-        fg = attrib.bgcol;
+    if (palette_glyphs) {
+        int stride = cells_stride((bbox.right - bbox.left) / 8);
+        update = spice_screen_update_from_palette_bitmap_cmd(
+            0, bbox, bitmap, cache_id, SPICE_BITMAP_FMT_4BIT_BE, stride, text_palette
+        );
     } else {
-        bg = attrib.bgcol;
-        fg = attrib.fgcol;
+        update = spice_screen_update_from_bitmap_cmd(0, bbox, bitmap, cache_id);
     }
+    update->bitmap = bitmap; // not kept in the image cache, free on release
 
-    if (attrib.bold) {
-        fg += 8;
+    return update;
+}
+
+/* render a run of cells on one row into a single bitmap (one drawable);
+ * 'keys' are their shadow keys, or NULL */
+static gboolean draw_cells(
+    SpiceScreen *spice_screen, int x, int y, TextCell *cells, const uint32_t *keys, int count
+) {
+    SimpleSpiceUpdate *update;
+
+    if (command_ring_full(spice_screen)) {
+        return FALSE;
     }
 
-    // unsuported attributes = (attrib.blink || attrib.unvisible)
+    if (count == 1) {
+        int fg, bg;
+        text_attributes_to_colors(cells->attrib, &fg, &bg);
+        int c = vt_fontmap[cells->ch];
+        update = spice_screen_draw_char_cmd(spice_screen, x, y, c, fg, bg, cells->attrib.uline);
+        push_command(spice_screen, &update->ext);
+        return TRUE;
+    }
+
+    uint64_t cache_id = keys ? span_cache_id(spice_screen, keys, count) : 0;
+    int stride = cells_stride(count);
+    uint8_t *bitmap = g_malloc(stride * 16);
+    QXLRect bbox;
 
-    int c = vt_fontmap[ch];
+    bbox.left = x * 8;
+    bbox.top = y * 16;
+    bbox.right = bbox.left + count * 8;
+    bbox.bottom = bbox.top + 16;
 
-    SimpleSpiceUpdate *update;
-    update = spice_screen_draw_char_cmd(spice_screen, x, y, c, fg, bg, attrib.uline);
+    render_cells(bitmap, stride, cells, count);
+
+    update = cells_bitmap_update(bbox, bitmap, cache_id);
     push_command(spice_screen, &update->ext);
+
+    return TRUE;
+}
+
+/* Draw the complete rows [y, y + count) as one bitmap if most of their
+ * cells changed, which is a single drawable instead of one per row (and
+ * per gap) when the whole screen gets repainted. Otherwise nothing is
+ * drawn, spice_screen_draw_text is cheaper then. rows[i] points to the
+ * 'cols' cells of row y + i. The selection is not drawn (see
+ * spice_screen_draw_text), so the rows still have to be passed to that.
+ */
+gboolean spice_screen_draw_band(
+    SpiceScreen *spice_screen, int y, TextCell *const *rows, int count, int cols
+) {
+    int cells = count * cols;
+    int changed = 0;
+    int i, r;
+
+    if (count <= 0 || y < 0 || y + count > spice_screen->shadow_rows ||
+        cols != spice_screen->shadow_cols) {
+        return TRUE;
+    }
+
+    if (command_ring_full(spice_screen)) {
+        return FALSE;
+    }
+
+    uint32_t *shadow = spice_screen->shadow + y * cols;
+    uint32_t *keys = g_new(uint32_t, cells);
+
+    for (r = 0; r < count; r++) {
+        for (i = 0; i < cols; i++) {
+            keys[r * cols + i] = shadow_cell_key(&rows[r][i]);
+        }
+    }
+
+    for (i = 0; i < cells; i++) {
+        if (keys[i] != (shadow[i] & ~SHADOW_INVERTED)) {
+            changed++;
+        }
+    }
+
+    if (changed * 2 > cells) {
+        int stride = cells_stride(cols);
+        uint8_t *bitmap = g_malloc(stride * 16 * count);
+        QXLRect bbox;
+
+        bbox.left = 0;
+        bbox.top = y * 16;
+        bbox.right = cols * 8;
+        bbox.bottom = (y + count) * 16;
+
+        for (r = 0; r < count; r++) {
+            render_cells(bitmap + r * 16 * stride, stride, rows[r], cols);
+        }
+
+        SimpleSpiceUpdate *update = cells_bitmap_update(bbox, bitmap, 0);
+        push_command(spice_screen, &update->ext);
+
+        memcpy(shadow, keys, cells * sizeof(uint32_t));
+    }
+
+    g_free(keys);
+
+    return TRUE;
+}
+
+static gboolean shadow_flip_needed(uint32_t key, int x, int inv_x1, int inv_x2) {
+    gboolean inverted = (key & SHADOW_INVERTED) != 0;
+    return inverted != (x >= inv_x1 && x < inv_x2);
+}
+
+/* Draw the cells which differ from the shadow grid; changed cells separated
+ * by less than SHADOW_MIN_GAP unchanged ones share a drawable. The columns
+ * [inv_x1, inv_x2) are shown inverted (the selection), which is an overlay
+ * like the cursor, so toggling it never re-renders the text. The inversion
+ * can cover text queued just before it, so it must keep the non-opaque effect
+ * spice_screen_invert gives it.
+ */
+gboolean spice_screen_draw_text(
+    SpiceScreen *spice_screen, int x, int y, TextCell *cells, int count, int inv_x1, int inv_x2
+) {
+    uint32_t keys[MAX_WIDTH / 8];
+    uint32_t *shadow = NULL;
+    int i;
+
+    if (count <= 0) {
+        return TRUE;
+    }
+
+    if (x >= 0 && y >= 0 && y < spice_screen->shadow_rows &&
+        x + count <= spice_screen->shadow_cols) {
+        shadow = spice_screen->shadow + y * spice_screen->shadow_cols + x;
+    }
+
+    if (!shadow) {
+        inv_x1 = MAX(inv_x1, x);
+        inv_x2 = MIN(inv_x2, x + count);
+        return draw_cells(spice_screen, x, y, cells, NULL, count) &&
+               (inv_x1 >= inv_x2 ||
+                spice_screen_invert(spice_screen, inv_x1 * 8, y * 16, inv_x2 * 8, y * 16 + 16));
+    }
+
+    for (i = 0; i < count; i++) {
+        keys[i] = shadow_cell_key(&cells[i]);
+    }
+
+    i = 0;
+    while (i < count) {
+        if (keys[i] == (shadow[i] & ~SHADOW_INVERTED)) {
+            i++;
+            continue;
+        }
+
+        int end = i + 1;
+        for (int j = end; j < count && j - end < SHADOW_MIN_GAP; j++) {
+            if (keys[j] != (shadow[j] & ~SHADOW_INVERTED)) {
+                end = j + 1;
+            }
+        }
+
+        if (!draw_cells(spice_screen, x + i, y, cells + i, keys + i, end - i)) {
+            return FALSE;
+        }
+        memcpy(shadow + i, keys + i, (end - i) * sizeof(uint32_t));
+
+        i = end;
+    }
+
+    /* now only the inverted state can differ */
+    i = 0;
+    while (i < count) {
+        int end = i;
+        while (end < count && shadow_flip_needed(shadow[end], x + end, inv_x1, inv_x2)) {
+            end++;
+        }
+
+        if (end == i) {
+            i++;
+            continue;
+        }
+
+        if (!spice_screen_invert(spice_screen, (x + i) * 8, y * 16, (x + end) * 8, y * 16 + 16)) {
+            return FALSE;
+        }
+
+        i = end;
+    }
+
+    return TRUE;
+}
+
+/* Off-screen pages: copies of the primary surface in off-screen surfaces
+ * (ids 1..SCREEN_PAGES), tagged with a key chosen by the caller. Restoring
+ * a page is a single surface to surface copy, which the client executes
+ * locally. A page also saves the shadow grid, so whatever changed since it
+ * was saved is redrawn by the next refresh.
+ */
+static void page_surface_create(SpiceScreen *spice_screen, int index) {
+    SavedPage *page = &spice_screen->pages[index];
+    int width = spice_screen->primary_width, height = spice_screen->primary_height;
+
+    page->data = g_malloc0(width * height * 4);
+    page->shadow = g_new(uint32_t, spice_screen->shadow_cols * spice_screen->shadow_rows);
+    page->valid = FALSE;
+
+    SimpleSurfaceCmd *cmd = g_new0(SimpleSurfaceCmd, 1);
+    QXLSurfaceCmd *surface_cmd = &cmd->surface_cmd;
+
+    set_cmd(&cmd->ext, QXL_CMD_SURFACE, (intptr_t)surface_cmd);
+    simple_set_release_info(&surface_cmd->release_info, (intptr_t)cmd);
+    surface_cmd->type = QXL_SURFACE_CMD_CREATE;
+    surface_cmd->surface_id = 1 + index;
+    surface_cmd->u.surface_create.format = SPICE_SURFACE_FMT_32_xRGB;
+    surface_cmd->u.surface_create.width = width;
+    surface_cmd->u.surface_create.height = height;
+    surface_cmd->u.surface_create.stride = -width * 4;
+    surface_cmd->u.surface_create.data = (intptr_t)page->data;
+
+    push_command(spice_screen, &cmd->ext);
+}
+
+/* Note: waits until the worker has processed all queued commands */
+static void page_surfaces_destroy(SpiceScreen *spice_screen) {
+    for (int i = 0; i < SCREEN_PAGES; i++) {
+        SavedPage *page = &spice_screen->pages[i];
+        if (!page->data) {
+            continue;
+        }
+        spice_qxl_destroy_surface_wait(&spice_screen->qxl_instance, 1 + i);
+        g_free(page->data);
+        g_free(page->shadow);
+        memset(page, 0, sizeof(*page));
+    }
+}
+
+/* copy the whole surface 'src_id' onto surface 'surface_id' */
+static SimpleSpiceUpdate *spice_screen_update_from_surface_cmd(
+    SpiceScreen *spice_screen, uint32_t surface_id, uint32_t src_id
+) {
+    SimpleSpiceUpdate *update = pool_alloc0(&update_pool);
+    QXLDrawable *drawable = &update->drawable;
+    QXLImage *image = &update->image;
+    QXLRect area = {
+        .right = spice_screen->primary_width,
+        .bottom = spice_screen->primary_height,
+    };
+
+    drawable->surface_id = surface_id;
+
+    drawable->bbox = area;
+    drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+    drawable->effect = QXL_EFFECT_OPAQUE;
+    simple_set_release_info(&drawable->release_info, (intptr_t)update);
+    drawable->type = QXL_DRAW_COPY;
+    drawable->surfaces_dest[0] = src_id;
+    drawable->surfaces_rects[0] = area;
+    drawable->surfaces_dest[1] = -1;
+    drawable->surfaces_dest[2] = -1;
+
+    drawable->u.copy.rop_descriptor = SPICE_ROPD_OP_PUT;
+    drawable->u.copy.src_bitmap = (intptr_t)image;
+    drawable->u.copy.src_area = area;
+
+    image->descriptor.id = ++unique;
+    image->descriptor.type = SPICE_IMAGE_TYPE_SURFACE;
+    image->descriptor.width = area.right;
+    image->descriptor.height = area.bottom;
+    image->surface_image.surface_id = src_id;
+
+    set_cmd(&update->ext, QXL_CMD_DRAW, (intptr_t)drawable);
+
+    return update;
+}
+
+static SavedPage *find_page(SpiceScreen *spice_screen, int key) {
+    for (int i = 0; i < SCREEN_PAGES; i++) {
+        SavedPage *page = &spice_screen->pages[i];
+        if (page->valid && page->key == key) {
+            return page;
+        }
+    }
+    return NULL;
+}
+
+/* an unused surface, else a new one, else the least recently used page;
+ * NULL if not even one page fits into SCREEN_PAGES_BUDGET */
+static SavedPage *page_to_replace(SpiceScreen *spice_screen) {
+    SavedPage *lru = NULL, *unused = NULL;
+    gsize page_size = (gsize)spice_screen->primary_width * spice_screen->primary_height * 4;
+    int pages = MIN(SCREEN_PAGES, SCREEN_PAGES_BUDGET / page_size);
+
+    for (int i = 0; i < pages; i++) {
+        SavedPage *page = &spice_screen->pages[i];
+        if (page->valid) {
+            if (!lru || page->used < lru->used) {
+                lru = page;
+            }
+        } else if (page->data) {
+            return page;
+        } else if (!unused) {
+            unused = page;
+        }
+    }
+
+    return unused ? unused : lru;
+}
+
+/* save the current screen contents as page 'key' */
+gboolean spice_screen_save_page(SpiceScreen *spice_screen, int key) {
+    SavedPage *page = find_page(spice_screen, key);
+    int index;
+
+    if (!page && !(page = page_to_replace(spice_screen))) {
+        return FALSE;
+    }
+    index = page - spice_screen->pages;
+
+    if (!page->data) {
+        if (command_ring_full(spice_screen)) {
+            return FALSE;
+        }
+        page_surface_create(spice_screen, index);
+    }
+
+    page->valid = FALSE;
+
+    if (command_ring_full(spice_screen)) {
+        return FALSE;
+    }
+
+    SimpleSpiceUpdate *update = spice_screen_update_from_surface_cmd(spice_screen, 1 + index, 0);
+    push_command(spice_screen, &update->ext);
+
+    memcpy(
+        page->shadow, spice_screen->shadow,
+        spice_screen->shadow_cols * spice_screen->shadow_rows * sizeof(uint32_t)
+    );
+    page->key = key;
+    page->valid = TRUE;
+    page->used = ++spice_screen->page_clock;
+
+    return TRUE;
+}
+
+/* put page 'key' back on the screen; FALSE if there is no such page (or
+ * the command ring is full) */
+gboolean spice_screen_restore_page(SpiceScreen *spice_screen, int key) {
+    SavedPage *page = find_page(spice_screen, key);
+
+    if (!page || command_ring_full(spice_screen)) {
+        return FALSE;
+    }
+
+    int index = page - spice_screen->pages;
+    SimpleSpiceUpdate *update = spice_screen_update_from_surface_cmd(spice_screen, 0, 1 + index);
+    push_command(spice_screen, &update->ext);
+
+    memcpy(
+        spice_screen->shadow, page->shadow,
+        spice_screen->shadow_cols * spice_screen->shadow_rows * sizeof(uint32_t)
+    );
+    page->used = ++spice_screen->page_clock;
+
+    return TRUE;
+}
+
+void spice_screen_forget_page(SpiceScreen *spice_screen, int key) {
+    SavedPage *page = find_page(spice_screen, key);
+
+    if (page) {
+        page->valid = FALSE;
+    }
 }
 
 SpiceScreen *spice_screen_new(
     SpiceCoreInterface *core, uint32_t width, uint32_t height, SpiceTermOptions *opts
 ) {
-    SpiceScreen *spice_screen = g_new0(SpiceScreen, 1);
+    SpiceScreen *spice_screen;
     SpiceServer *server = spice_server_new();
     char *x509_key_file = "/etc/pve/local/pve-ssl.key";
     char *x509_cert_file = "/etc/pve/local/pve-ssl.pem";
@@ -659,14 +1846,17 @@ SpiceScreen *spice_screen_new(
     char *x509_dh_file = NULL;
     char *tls_ciphers = "HIGH";
 
+    /* malloc alignment is not enough for the cache line aligned command ring */
+    if (posix_memalign((void **)&spice_screen, 64, sizeof(SpiceScreen)) != 0) {
+        g_error("out of memory");
+    }
+    memset(spice_screen, 0, sizeof(SpiceScreen));
+
     spice_screen->width = width;
     spice_screen->height = height;
 
     spice_screen->client_count = 0;
 
-    g_cond_init(&spice_screen->command_cond);
-    g_mutex_init(&spice_screen->command_mutex);
-
     spice_screen->on_client_connected = client_connected,
     spice_screen->on_client_disconnected = client_disconnected,
 
@@ -684,7 +1874,8 @@ SpiceScreen *spice_screen_new(
     }
 
     // spice_server_set_port(spice_server, port);
-    // spice_server_set_image_compression(server, SPICE_IMAGE_COMPRESS_OFF);
+
+    compression_init(spice_screen, opts);
 
     spice_server_set_tls(
         server, opts->port, x509_cacert_file, x509_cert_file, x509_key_file, x509_key_password,
@@ -707,7 +1898,21 @@ SpiceScreen *spice_screen_new(
         g_error("spice_server_init failed, res = %d\n", res);
     }
 
+    pool_init(&update_pool, "update", sizeof(SimpleSpiceUpdate));
+    pool_init(&cursor_pool, "cursor", sizeof(SimpleSpiceCursor));
+
     cursor_init();
+    expand_glyph = expand_glyph_best();
+
+    if (!opts->truecolor_glyphs) {
+        palette_glyphs_init();
+    } else if (opts->glyph_atlas) {
+        glyph_atlas_init(opts->glyph_atlas);
+    }
+
+    spice_screen->image_cache_max_bytes = (gsize)opts->image_cache_size * 1024;
+
+    compression_start(spice_screen, opts);
 
     if (opts->timeout > 0) {
         spice_screen->conn_timeout_timer = core->timer_add(do_conn_timeout, spice_screen);
@@ -724,11 +1929,13 @@ void spice_screen_resize(SpiceScreen *spice_screen, uint32_t width, uint32_t hei
         return;
     }
 
+    page_surfaces_destroy(spice_screen);
+
     discard_pending_commands(spice_screen);
 
     spice_qxl_destroy_primary_surface(&spice_screen->qxl_instance, 0);
 
     create_primary_surface(spice_screen, width, height);
 
-    spice_screen_clear(spice_screen, 0, 0, width, height);
+    spice_screen_clear(spice_screen, 0, 0, width, height, (TextAttributes){0});
 }
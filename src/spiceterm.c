@@ -69,72 +69,258 @@ static int debug = 0;
 
 /* these colours are from linux kernel drivers/char/vt.c */
 
+#define FLUSH_RETRY_INTERVAL 5 // ms, used while the command ring is full
+
+#define PTY_READ_BUDGET (64 * 1024) // bytes read per pty wakeup, see master_watch
+
+// frame rate adaption (see spiceterm_adapt_flush_interval)
+#define FLUSH_BACKLOG_HIGH (COMMANDS_SIZE / 4) // queued commands
+#define FLUSH_BACKLOG_LOW (COMMANDS_SIZE / 32)
+#define FLUSH_INTERVAL_STEP 2 // ms
+#define JUMP_SCROLL_INTERVAL 40 // ms, minimum time between frames while jump scrolling
+
+/* page keys (spice_screen_save_page): the main screen while the alternate
+ * buffer is active, otherwise the y_displ of a scrollback view */
+#define PAGE_MAIN_SCREEN -1
+
 unsigned char color_table[] = {0, 4, 2, 6, 1, 5, 3, 7, 8, 12, 10, 14, 9, 13, 11, 15};
 
-static void draw_char_at(spiceTerm *vt, int x, int y, gunichar2 ch, TextAttributes attrib) {
-    if (x < 0 || y < 0 || x >= vt->width || y >= vt->height) {
-        return;
+static void spiceterm_damage(spiceTerm *vt, int x, int y) {
+    if (vt->dirty_x2[y] <= vt->dirty_x1[y]) {
+        vt->dirty_x1[y] = x;
+        vt->dirty_x2[y] = x + 1;
+    } else if (x < vt->dirty_x1[y]) {
+        vt->dirty_x1[y] = x;
+    } else if (x >= vt->dirty_x2[y]) {
+        vt->dirty_x2[y] = x + 1;
     }
 
-    spice_screen_draw_char(vt->screen, x, y, ch, attrib);
+    vt->damaged = TRUE;
 }
 
-static void spiceterm_update_xy(spiceTerm *vt, int x, int y) {
-    if (x < 0 || y < 0 || x >= vt->width || y >= vt->height) {
-        return;
+static void spiceterm_damage_all(spiceTerm *vt) {
+    int y;
+
+    for (y = 0; y < vt->height; y++) {
+        vt->dirty_x1[y] = 0;
+        vt->dirty_x2[y] = vt->width;
     }
 
-    int y1 = (vt->y_base + y) % vt->total_height;
-    int y2 = y1 - vt->y_displ;
-    if (y2 < 0) {
-        y2 += vt->total_height;
+    vt->damaged = TRUE;
+
+    /* everything gets repainted, no need to move pixels first */
+    vt->pending_scroll = 0;
+
+    /* the cursor gets painted over */
+    vt->cursor_drawn = FALSE;
+}
+
+static void spiceterm_discard_damage(spiceTerm *vt) {
+    int y;
+
+    for (y = 0; y < vt->height; y++) {
+        vt->dirty_x2[y] = vt->dirty_x1[y];
     }
-    if (y2 < vt->height) {
-        TextCell *c = &vt->cells[y1 * vt->width + x];
-        draw_char_at(vt, x, y2, c->ch, c->attrib);
+
+    vt->damaged = FALSE;
+    vt->pending_scroll = 0;
+}
+
+/* the columns [*x1, *x2) of display row y which are marked */
+static gboolean spiceterm_selected_cols(spiceTerm *vt, int y, int *x1, int *x2) {
+    int n = vt->total_height * vt->width;
+    int row = ((vt->y_displ + y) % vt->total_height) * vt->width;
+
+    if (!vt->sel_len) {
+        return FALSE;
+    }
+
+    int offset = (row - vt->sel_start + n) % n; /* of the row within the selection */
+    if (offset < vt->sel_len) {
+        *x1 = 0;
+        *x2 = MIN(vt->width, vt->sel_len - offset);
+        return TRUE;
+    }
+
+    if (vt->sel_start >= row && vt->sel_start < row + vt->width) {
+        *x1 = vt->sel_start - row;
+        *x2 = MIN(vt->width, *x1 + vt->sel_len);
+        return TRUE;
     }
+
+    return FALSE;
 }
 
-static void spiceterm_clear_xy(spiceTerm *vt, int x, int y) {
-    if (x < 0 || y < 0 || x >= vt->width || y >= vt->height) {
+/* The selection is inverted on top of the cells (see spiceterm_render_damage),
+ * so whatever paints cells without it, like a fill, has to damage the marked
+ * cells of the rows [y1, y2) afterwards.
+ */
+static void spiceterm_damage_selection(spiceTerm *vt, int y1, int y2) {
+    int x1, x2, y;
+
+    for (y = MAX(y1, 0); y < MIN(y2, vt->height); y++) {
+        if (spiceterm_selected_cols(vt, y, &x1, &x2)) {
+            spiceterm_damage(vt, x1, y);
+            spiceterm_damage(vt, x2 - 1, y);
+        }
+    }
+}
+
+/* Moving pixels within the rows [y1, y2) also moves the inverted cells, while
+ * the selection stays where it is. Repaint these rows if they show any of it.
+ */
+static void spiceterm_damage_moved_selection(spiceTerm *vt, int x1, int y1, int y2) {
+    int sel_x1, sel_x2, y;
+
+    for (y = y1; y < y2; y++) {
+        if (spiceterm_selected_cols(vt, y, &sel_x1, &sel_x2)) {
+            break;
+        }
+    }
+
+    if (y == y2) {
         return;
     }
 
-    int y1 = (vt->y_base + y) % vt->total_height;
-    int y2 = y1 - vt->y_displ;
-    if (y2 < 0) {
-        y2 += vt->total_height;
+    for (y = y1; y < y2; y++) {
+        spiceterm_damage(vt, x1, y);
+        spiceterm_damage(vt, vt->width - 1, y);
     }
-    if (y2 < vt->height) {
-        TextCell *c = &vt->cells[y1 * vt->width + x];
-        c->ch = ' ';
-        c->attrib = vt->default_attrib;
-        c->attrib.fgcol = vt->cur_attrib.fgcol;
-        c->attrib.bgcol = vt->cur_attrib.bgcol;
+}
 
-        draw_char_at(vt, x, y, c->ch, c->attrib);
+/* The cursor is an inverted cell on top of the text (QXL_DRAW_INVERS), so
+ * inverting it again removes it. Redrawing the cell does the same, which is
+ * needed if the command ring is full or the pixels have not been moved by
+ * the pending scroll yet (cursor_y already has). */
+static void spiceterm_hide_cursor(spiceTerm *vt) {
+    if (vt->cursor_drawn) {
+        int x = vt->cursor_x * 8, y = vt->cursor_y * 16;
+        vt->cursor_drawn = FALSE;
+        if (vt->pending_scroll || !spice_screen_invert(vt->screen, x, y, x + 8, y + 16)) {
+            spiceterm_damage(vt, vt->cursor_x, vt->cursor_y);
+        }
     }
 }
 
-void spiceterm_toggle_marked_cell(spiceTerm *vt, int pos) {
-    int x = (pos % vt->width);
-    int y = (pos / vt->width);
+/* Line feeds at the bottom of the screen only scroll the damage map (see
+ * spiceterm_defer_scroll). Move the pixels now, with a single QXL_COPY_BITS
+ * for all accumulated lines, and fill the exposed rows. Must happen before
+ * anything else is drawn, because the damage is in scrolled coordinates.
+ */
+static gboolean spiceterm_apply_scroll(spiceTerm *vt) {
+    int lines = vt->pending_scroll;
+    int y;
 
-    if (x < 0 || y < 0 || x >= vt->width || y >= vt->height) {
-        return;
+    if (!lines) {
+        return TRUE;
+    }
+
+    int w = vt->screen->primary_width;
+    int h = lines * 16;
+    int y2 = vt->height * 16;
+
+    if (lines < vt->height && !spice_screen_scroll(vt->screen, 0, 0, w, y2 - h, 0, h)) {
+        return FALSE;
+    }
+
+    vt->pending_scroll = 0;
+
+    /* the exposed rows were blanked with default_attrib by spiceterm_put_lf */
+    if (!spice_screen_clear(vt->screen, 0, y2 - h, w, y2, vt->default_attrib)) {
+        for (y = vt->height - lines; y < vt->height; y++) {
+            vt->dirty_x1[y] = 0;
+            vt->dirty_x2[y] = vt->width;
+        }
+        vt->damaged = TRUE;
+    } else {
+        spiceterm_damage_selection(vt, vt->height - lines, vt->height);
     }
 
-    int y1 = (vt->y_displ + y) % vt->total_height;
+    return TRUE;
+}
+
+/* Scroll the whole screen up by one line, but only in the damage map */
+static void spiceterm_defer_scroll(spiceTerm *vt) {
+    int h = vt->height;
+
+    memmove(vt->dirty_x1, vt->dirty_x1 + 1, (h - 1) * sizeof(int));
+    memmove(vt->dirty_x2, vt->dirty_x2 + 1, (h - 1) * sizeof(int));
+    vt->dirty_x2[h - 1] = vt->dirty_x1[h - 1]; /* filled by spiceterm_apply_scroll */
+
+    if (vt->pending_scroll < h) {
+        vt->pending_scroll++;
+    }
+
+    /* the drawn cursor moves along with the pixels */
+    if (vt->cursor_drawn && --vt->cursor_y < 0) {
+        vt->cursor_drawn = FALSE;
+    }
+}
+
+/* Draw the damaged part of each display row as a single span, runs of
+ * completely damaged rows as bands first. Returns FALSE if the command
+ * ring filled up; the remaining rows stay damaged.
+ */
+static gboolean spiceterm_render_damage(spiceTerm *vt) {
+    int band_end = 0;
+    int y;
+
+    if (!spiceterm_apply_scroll(vt)) {
+        return FALSE;
+    }
+
+    if (!vt->damaged) {
+        return TRUE;
+    }
+
+    for (y = 0; y < vt->height; y++) {
+        int x1 = vt->dirty_x1[y];
+        int count = vt->dirty_x2[y] - x1;
+
+        if (count <= 0) {
+            continue;
+        }
+
+        /* runs of complete rows (e.g. after spiceterm_refresh) go out as bands */
+        if (y >= band_end && count == vt->width) {
+            TextCell *rows[BAND_ROWS];
+            int n = 0;
+            while (n < BAND_ROWS && y + n < vt->height && vt->dirty_x1[y + n] == 0 &&
+                   vt->dirty_x2[y + n] == vt->width) {
+                rows[n] = &vt->cells[((vt->y_displ + y + n) % vt->total_height) * vt->width];
+                n++;
+            }
+            if (n > 1 && !spice_screen_draw_band(vt->screen, y, rows, n, vt->width)) {
+                return FALSE;
+            }
+            band_end = y + n;
+        }
 
-    TextCell *c = &vt->cells[y1 * vt->width + x];
-    c->attrib.selected = c->attrib.selected ? 0 : 1;
+        int y1 = (vt->y_displ + y) % vt->total_height;
+        int sel_x1 = 0, sel_x2 = 0;
+        spiceterm_selected_cols(vt, y, &sel_x1, &sel_x2);
+        if (!spice_screen_draw_text(
+                vt->screen, x1, y, &vt->cells[y1 * vt->width + x1], count, sel_x1, sel_x2
+            )) {
+            return FALSE;
+        }
 
-    if (y < vt->height) {
-        draw_char_at(vt, x, y, c->ch, c->attrib);
+        vt->dirty_x2[y] = x1;
     }
+
+    vt->damaged = FALSE;
+
+    return TRUE;
+}
+
+/* must be called before anything moves pixels on the screen */
+static gboolean spiceterm_flush_damage(spiceTerm *vt) {
+    spiceterm_hide_cursor(vt);
+    return spiceterm_render_damage(vt);
 }
 
-static void spiceterm_show_cursor(spiceTerm *vt, int show) {
+/* returns FALSE if the cursor is not inside the displayed area */
+static gboolean spiceterm_cursor_pos(spiceTerm *vt, int *px, int *py) {
     int x = vt->cx;
     if (x >= vt->width) {
         x = vt->width - 1;
@@ -146,76 +332,306 @@ static void spiceterm_show_cursor(spiceTerm *vt, int show) {
         y += vt->total_height;
     }
 
-    if (y < vt->height) {
+    *px = x;
+    *py = y;
+
+    return y < vt->height;
+}
+
+/* Adapt the frame rate to the client. If the worker did not take the
+ * commands of the previous frames yet, the client drains them slower than
+ * we produce: double the flush interval, so more changes get coalesced
+ * into each frame. Speed up again in small steps while the ring stays
+ * nearly empty (AIMD, like TCP congestion control).
+ */
+static void spiceterm_adapt_flush_interval(spiceTerm *vt, gboolean ring_full) {
+    guint backlog = spice_screen_backlog(vt->screen);
+    guint interval = vt->flush_interval;
+
+    /* 0 means draw after each write, keep it that way */
+    if (!vt->min_flush_interval || vt->max_flush_interval <= vt->min_flush_interval) {
+        return;
+    }
+
+    if (ring_full || backlog >= FLUSH_BACKLOG_HIGH) {
+        interval = MIN(MAX(interval * 2, FLUSH_INTERVAL_STEP), vt->max_flush_interval);
+    } else if (backlog <= FLUSH_BACKLOG_LOW) {
+        guint min = vt->min_flush_interval;
+        interval = interval > min + FLUSH_INTERVAL_STEP ? interval - FLUSH_INTERVAL_STEP : min;
+    }
+
+    if (interval != vt->flush_interval) {
+        DPRINTF(1, "flush interval %u ms (backlog %u)", interval, backlog);
+        vt->flush_interval = interval;
+    }
+}
+
+static void spiceterm_flush_timeout(void *opaque);
+
+static void spiceterm_flush(spiceTerm *vt) {
+    int x, y;
+
+    if (vt->flush_pending) {
+        vt->flush_pending = FALSE;
+        vt->screen->core->timer_cancel(vt->flush_timer);
+    }
+
+    gboolean show = spiceterm_cursor_pos(vt, &x, &y) && vt->cursor_visible;
+
+    if (vt->cursor_drawn) {
+        if (vt->cursor_x >= vt->dirty_x1[vt->cursor_y] &&
+            vt->cursor_x < vt->dirty_x2[vt->cursor_y]) {
+            vt->cursor_drawn = FALSE; /* painted over below */
+        } else if (!show || x != vt->cursor_x || y != vt->cursor_y) {
+            spiceterm_hide_cursor(vt);
+        }
+    }
 
-        TextCell *c = &vt->cells[y1 * vt->width + x];
+    gboolean done = spiceterm_render_damage(vt);
 
-        if (show) {
-            TextAttributes attrib = vt->default_attrib;
-            attrib.invers = !(attrib.invers); /* invert fg and bg */
-            draw_char_at(vt, x, y, c->ch, attrib);
+    if (done && show && !vt->cursor_drawn) {
+        if (spice_screen_invert(vt->screen, x * 8, y * 16, x * 8 + 8, y * 16 + 16)) {
+            vt->cursor_drawn = TRUE;
+            vt->cursor_x = x;
+            vt->cursor_y = y;
         } else {
-            draw_char_at(vt, x, y, c->ch, c->attrib);
+            done = FALSE;
         }
     }
+
+    vt->last_flush = g_get_monotonic_time();
+
+    spiceterm_adapt_flush_interval(vt, !done);
+
+    /* The command ring is full. Keep the damage (further changes simply
+     * accumulate) and retry once the worker had time to drain it, no sooner
+     * than the (just increased) flush interval on a congested link.
+     */
+    if (!done) {
+        vt->flush_pending = TRUE;
+        guint retry = MAX(FLUSH_RETRY_INTERVAL, vt->flush_interval);
+        vt->screen->core->timer_start(vt->flush_timer, retry);
+    }
 }
 
-void spiceterm_refresh(spiceTerm *vt) {
-    int x, y, y1;
+static void spiceterm_flush_timeout(void *opaque) {
+    spiceTerm *vt = (spiceTerm *)opaque;
 
-    y1 = vt->y_displ;
-    for (y = 0; y < vt->height; y++) {
-        TextCell *c = vt->cells + y1 * vt->width;
-        for (x = 0; x < vt->width; x++) {
-            draw_char_at(vt, x, y, c->ch, c->attrib);
-            c++;
+    vt->flush_pending = FALSE;
+
+    spiceterm_flush(vt);
+}
+
+/* Flush right away if 'urgent' and the last flush is at least flush_interval
+ * ago, otherwise leave it to the flush timer. This coalesces all changes
+ * within one interval into a single drawable per row. While jump scrolling
+ * only the timer flushes, at most every JUMP_SCROLL_INTERVAL.
+ */
+static void spiceterm_schedule_flush(spiceTerm *vt, gboolean urgent) {
+    guint interval = vt->flush_interval;
+
+    if (vt->jump_scroll) {
+        interval = MAX(interval, JUMP_SCROLL_INTERVAL);
+        urgent = FALSE;
+    }
+
+    if (!interval || (urgent && g_get_monotonic_time() - vt->last_flush >= interval * 1000)) {
+        spiceterm_flush(vt);
+        return;
+    }
+
+    if (!vt->flush_pending) {
+        vt->flush_pending = TRUE;
+        vt->screen->core->timer_start(vt->flush_timer, interval);
+    }
+}
+
+static void spiceterm_update_xy(spiceTerm *vt, int x, int y) {
+    if (x < 0 || y < 0 || x >= vt->width || y >= vt->height) {
+        return;
+    }
+
+    int y1 = (vt->y_base + y) % vt->total_height;
+    int y2 = y1 - vt->y_displ;
+    if (y2 < 0) {
+        y2 += vt->total_height;
+    }
+    if (y2 < vt->height) {
+        spiceterm_damage(vt, x, y2);
+    }
+}
+
+/* damage the complete terminal rows [y1, y2) */
+static void spiceterm_update_rows(spiceTerm *vt, int y1, int y2) {
+    int y;
+
+    for (y = y1; y < y2; y++) {
+        spiceterm_update_xy(vt, 0, y);
+        spiceterm_update_xy(vt, vt->width - 1, y);
+    }
+}
+
+/* Clear the cells [x1, x2) of the rows [y1, y2) and paint them with one
+ * solid fill per region instead of rendering blank glyphs.
+ */
+static void spiceterm_clear_region(spiceTerm *vt, int x1, int y1, int x2, int y2) {
+    int x, y;
+
+    x1 = MAX(x1, 0);
+    y1 = MAX(y1, 0);
+    x2 = MIN(x2, vt->width);
+    y2 = MIN(y2, vt->height);
+
+    if (x1 >= x2 || y1 >= y2) {
+        return;
+    }
+
+    TextAttributes attrib = vt->default_attrib;
+    attrib.fgcol = vt->cur_attrib.fgcol;
+    attrib.bgcol = vt->cur_attrib.bgcol;
+
+    for (y = y1; y < y2; y++) {
+        TextCell *c = &vt->cells[((vt->y_base + y) % vt->total_height) * vt->width + x1];
+        for (x = x1; x < x2; x++, c++) {
+            c->ch = ' ';
+            c->attrib = attrib;
+        }
+    }
+
+    /* display rows only match terminal rows if we are not scrolled back */
+    if (vt->jump_scroll || vt->y_displ != vt->y_base || !spiceterm_apply_scroll(vt) ||
+        !spice_screen_clear(vt->screen, x1 * 8, y1 * 16, x2 * 8, y2 * 16, attrib)) {
+        for (y = y1; y < y2; y++) {
+            spiceterm_update_xy(vt, x1, y);
+            spiceterm_update_xy(vt, x2 - 1, y);
+        }
+        return;
+    }
+
+    /* pending damage inside the filled area is already up to date */
+    for (y = y1; y < y2; y++) {
+        if (vt->dirty_x2[y] <= vt->dirty_x1[y]) {
+            continue;
+        }
+        if (x1 <= vt->dirty_x1[y] && x2 >= vt->dirty_x2[y]) {
+            vt->dirty_x2[y] = vt->dirty_x1[y];
+        } else if (x1 <= vt->dirty_x1[y] && x2 > vt->dirty_x1[y]) {
+            vt->dirty_x1[y] = x2;
+        } else if (x2 >= vt->dirty_x2[y] && x1 < vt->dirty_x2[y]) {
+            vt->dirty_x2[y] = x1;
+        }
+    }
+
+    if (vt->cursor_drawn && vt->cursor_x >= x1 && vt->cursor_x < x2 && vt->cursor_y >= y1 &&
+        vt->cursor_y < y2) {
+        vt->cursor_drawn = FALSE; /* painted over */
+    }
+
+    spiceterm_damage_selection(vt, y1, y2);
+}
+
+/* Move the cells [x1, width) of row y by 'n' columns (to the right if n is
+ * positive), dropping what falls off the row end, and clear the vacated
+ * cells. The pixels move with one in-row QXL_COPY_BITS, pending damage
+ * moves along with the cells.
+ */
+static void spiceterm_shift_row(spiceTerm *vt, int x1, int y, int n) {
+    int from = n > 0 ? x1 : x1 - n;
+    int to = n > 0 ? x1 + n : x1;
+    int count = vt->width - MAX(from, to); // cells which stay on the row
+
+    if (count > 0) {
+        TextCell *row = &vt->cells[((vt->y_base + y) % vt->total_height) * vt->width];
+        memmove(row + to, row + from, count * sizeof(TextCell));
+
+        gboolean moved = FALSE;
+        if (!vt->jump_scroll && vt->y_displ == vt->y_base && spiceterm_apply_scroll(vt)) {
+            if (vt->cursor_drawn && vt->cursor_y == y && vt->cursor_x >= x1) {
+                spiceterm_hide_cursor(vt);
+            }
+            moved = spice_screen_scroll(
+                vt->screen, to * 8, y * 16, (to + count) * 8, (y + 1) * 16, from * 8, y * 16
+            );
         }
-        if (++y1 == vt->total_height) {
-            y1 = 0;
+
+        if (!moved) {
+            spiceterm_update_xy(vt, to, y);
+            spiceterm_update_xy(vt, to + count - 1, y);
+        } else if (vt->dirty_x2[y] > vt->dirty_x1[y] && vt->dirty_x2[y] > from) {
+            int d1 = MAX(vt->dirty_x1[y], from) + to - from;
+            int d2 = MIN(vt->dirty_x2[y], from + count) + to - from;
+            if (vt->dirty_x1[y] < x1) { /* damage left of x1 stays */
+                d1 = vt->dirty_x1[y];
+                d2 = MAX(d2, MIN(vt->dirty_x2[y], x1));
+            }
+            vt->dirty_x1[y] = d1;
+            vt->dirty_x2[y] = d2;
+        }
+
+        if (moved) {
+            spiceterm_damage_moved_selection(vt, x1, y, y + 1);
         }
     }
 
-    spiceterm_show_cursor(vt, 1);
+    if (n > 0) {
+        spiceterm_clear_region(vt, x1, y, x1 + n, y + 1);
+    } else {
+        spiceterm_clear_region(vt, vt->width + n, y, vt->width, y + 1);
+    }
+}
+
+/* mark the display positions (y * width + x) [from, to] */
+static void spiceterm_select(spiceTerm *vt, int from, int to) {
+    int y1 = (vt->y_displ + from / vt->width) % vt->total_height;
+
+    spiceterm_damage_selection(vt, 0, vt->height);
+
+    vt->sel_start = y1 * vt->width + from % vt->width;
+    vt->sel_len = to - from + 1;
+
+    spiceterm_damage_selection(vt, 0, vt->height);
+}
+
+void spiceterm_refresh(spiceTerm *vt) {
+    spiceterm_damage_all(vt);
+    spiceterm_schedule_flush(vt, FALSE);
 }
 
 static void spiceterm_clear_screen(spiceTerm *vt) {
     int x, y;
 
+    TextAttributes attrib = vt->default_attrib;
+    attrib.fgcol = vt->cur_attrib.fgcol;
+    attrib.bgcol = vt->cur_attrib.bgcol;
+
     for (y = 0; y <= vt->height; y++) {
         int y1 = (vt->y_base + y) % vt->total_height;
         TextCell *c = &vt->cells[y1 * vt->width];
         for (x = 0; x < vt->width; x++) {
             c->ch = ' ';
-            c->attrib = vt->default_attrib;
-            c->attrib.fgcol = vt->cur_attrib.fgcol;
-            c->attrib.bgcol = vt->cur_attrib.bgcol;
+            c->attrib = attrib;
 
             c++;
         }
     }
 
-    spice_screen_clear(vt->screen, 0, 0, vt->screen->primary_width, vt->screen->primary_height);
+    /* the whole screen gets wiped, so pending damage is moot */
+    spiceterm_discard_damage(vt);
+    vt->cursor_drawn = FALSE;
+
+    if (!spice_screen_clear(
+            vt->screen, 0, 0, vt->screen->primary_width, vt->screen->primary_height, attrib
+        ) ||
+        vt->y_displ != vt->y_base) {
+        spiceterm_damage_all(vt);
+    } else {
+        spiceterm_damage_selection(vt, 0, vt->height);
+    }
 }
 
 void spiceterm_unselect_all(spiceTerm *vt) {
-    int x, y, y1;
-
-    y1 = vt->y_displ;
-    for (y = 0; y < vt->total_height; y++) {
-        TextCell *c = vt->cells + y1 * vt->width;
-        for (x = 0; x < vt->width; x++) {
-            if (c->attrib.selected) {
-                c->attrib.selected = 0;
-                if (y < vt->height) {
-                    draw_char_at(vt, x, y, c->ch, c->attrib);
-                }
-            }
-            c++;
-        }
-        if (++y1 == vt->total_height) {
-            y1 = 0;
-        }
-    }
+    spiceterm_damage_selection(vt, 0, vt->height);
+    vt->sel_len = 0;
 }
 
 static void spiceterm_scroll_down(spiceTerm *vt, int top, int bottom, int lines) {
@@ -227,6 +643,9 @@ static void spiceterm_scroll_down(spiceTerm *vt, int top, int bottom, int lines)
         return;
     }
 
+    /* while jump scrolling the rows are simply repainted with the next frame */
+    gboolean flushed = !vt->jump_scroll && spiceterm_flush_damage(vt);
+
     int i;
     for (i = bottom - top - lines - 1; i >= 0; i--) {
         int src = ((vt->y_base + top + i) % vt->total_height) * vt->width;
@@ -250,8 +669,23 @@ static void spiceterm_scroll_down(spiceTerm *vt, int top, int bottom, int lines)
     int y1 = y0 + h;
     int y2 = bottom * 16;
 
-    spice_screen_scroll(vt->screen, 0, y1, vt->screen->primary_width, y2, 0, y0);
-    spice_screen_clear(vt->screen, 0, y0, vt->screen->primary_width, y1);
+    if (vt->jump_scroll) {
+        spiceterm_update_rows(vt, top, bottom);
+        return;
+    }
+
+    /* if the command ring is full, repaint everything from the cells later */
+    if (!flushed ||
+        !spice_screen_scroll(vt->screen, 0, y1, vt->screen->primary_width, y2, 0, y0)) {
+        spiceterm_damage_all(vt);
+        return;
+    }
+
+    if (!spice_screen_clear(vt->screen, 0, y0, vt->screen->primary_width, y1, vt->default_attrib)) {
+        spiceterm_update_rows(vt, top, top + lines);
+    }
+
+    spiceterm_damage_moved_selection(vt, 0, top, bottom);
 }
 
 static void spiceterm_scroll_up(spiceTerm *vt, int top, int bottom, int lines, int moveattr) {
@@ -268,8 +702,23 @@ static void spiceterm_scroll_up(spiceTerm *vt, int top, int bottom, int lines, i
     int y1 = (top + lines) * 16;
     int y2 = bottom * 16;
 
-    spice_screen_scroll(vt->screen, 0, y0, vt->screen->primary_width, y2 - h, 0, y1);
-    spice_screen_clear(vt->screen, 0, y2 - h, vt->screen->primary_width, y2);
+    int i;
+
+    /* While jump scrolling the rows are simply repainted with the next frame.
+     * If the command ring is full, repaint everything from the cells later. */
+    if (vt->jump_scroll) {
+        spiceterm_update_rows(vt, top, bottom);
+    } else if (!spiceterm_flush_damage(vt) ||
+               !spice_screen_scroll(vt->screen, 0, y0, vt->screen->primary_width, y2 - h, 0, y1)) {
+        spiceterm_damage_all(vt);
+    } else {
+        if (!spice_screen_clear(
+                vt->screen, 0, y2 - h, vt->screen->primary_width, y2, vt->default_attrib
+            )) {
+            spiceterm_update_rows(vt, bottom - lines, bottom);
+        }
+        spiceterm_damage_moved_selection(vt, 0, top, bottom);
+    }
 
     if (!moveattr) {
         return;
@@ -277,7 +726,6 @@ static void spiceterm_scroll_up(spiceTerm *vt, int top, int bottom, int lines, i
 
     // move attributes
 
-    int i;
     for (i = 0; i < (bottom - top - lines); i++) {
         int dst = ((vt->y_base + top + i) % vt->total_height) * vt->width;
         int src = ((vt->y_base + top + lines + i) % vt->total_height) * vt->width;
@@ -296,7 +744,53 @@ static void spiceterm_scroll_up(spiceTerm *vt, int top, int bottom, int lines, i
     }
 }
 
+/* Move the displayed pixels by 'moved' lines (positive = up) after y_displ
+ * changed, and repaint only the exposed rows. The screen must be up to date
+ * with the old y_displ, i.e. all damage flushed.
+ */
+static void spiceterm_scroll_display(spiceTerm *vt, int moved) {
+    int n = moved < 0 ? -moved : moved;
+    int y;
+
+    int w = vt->screen->primary_width;
+    int h = (vt->height - n) * 16;
+    gboolean res;
+
+    if (moved > 0) {
+        res = spice_screen_scroll(vt->screen, 0, 0, w, h, 0, n * 16);
+    } else {
+        res = spice_screen_scroll(vt->screen, 0, n * 16, w, n * 16 + h, 0, 0);
+    }
+
+    if (!res) {
+        spiceterm_damage_all(vt);
+        return;
+    }
+
+    for (y = 0; y < n; y++) {
+        int row = moved > 0 ? vt->height - n + y : y;
+        vt->dirty_x1[row] = 0;
+        vt->dirty_x2[row] = vt->width;
+    }
+    vt->damaged = TRUE;
+}
+
+/* Back from the scrollback. The live screen was kept as a page when we
+ * scrolled away from it, so the refresh usually only draws what changed.
+ */
+void spiceterm_show_live_view(spiceTerm *vt) {
+    if (vt->y_displ == vt->y_base) {
+        return;
+    }
+
+    vt->y_displ = vt->y_base;
+    spice_screen_restore_page(vt->screen, vt->y_displ);
+    spiceterm_refresh(vt);
+}
+
 void spiceterm_virtual_scroll(spiceTerm *vt, int lines) {
+    int moved = 0;
+
     if (vt->altbuf || lines == 0) {
         return;
     }
@@ -318,6 +812,7 @@ void spiceterm_virtual_scroll(spiceTerm *vt, int lines) {
             if (--vt->y_displ < 0) {
                 vt->y_displ = vt->total_height - 1;
             }
+            moved--;
         }
     } else {
         int i;
@@ -328,10 +823,33 @@ void spiceterm_virtual_scroll(spiceTerm *vt, int lines) {
             if (++vt->y_displ == vt->total_height) {
                 vt->y_displ = 0;
             }
+            moved++;
         }
     }
 
-    spiceterm_refresh(vt);
+    if (!moved) {
+        return;
+    }
+
+    /* Blit what stays visible. The pending damage refers to the old view,
+     * so it has to be drawn first - with the old y_displ. The old view is
+     * kept as a page, so coming back to it costs a single copy. */
+    int y_displ = vt->y_displ;
+    vt->y_displ = (y_displ - moved + vt->total_height) % vt->total_height;
+    gboolean flushed = spiceterm_flush_damage(vt);
+    if (flushed) {
+        spice_screen_save_page(vt->screen, vt->y_displ);
+    }
+    vt->y_displ = y_displ;
+
+    if (!flushed || spice_screen_restore_page(vt->screen, vt->y_displ) ||
+        moved >= vt->height || -moved >= vt->height) {
+        spiceterm_refresh(vt);
+        return;
+    }
+
+    spiceterm_scroll_display(vt, moved);
+    spiceterm_schedule_flush(vt, FALSE);
 }
 
 void spiceterm_respond_esc(spiceTerm *vt, const char *esc) {
@@ -371,7 +889,7 @@ static void spiceterm_put_lf(spiceTerm *vt) {
         }
 
         if (vt->y_displ == vt->y_base) {
-            spiceterm_scroll_up(vt, vt->region_top, vt->region_bottom, 1, 0);
+            spiceterm_defer_scroll(vt);
         }
 
         if (vt->y_displ == vt->y_base) {
@@ -523,7 +1041,8 @@ static void spiceterm_restore_cursor(spiceTerm *vt) {
 static void spiceterm_set_alternate_buffer(spiceTerm *vt, int on_off) {
     int x, y;
 
-    vt->y_displ = vt->y_base;
+    gboolean live = vt->y_displ == vt->y_base;
+    spiceterm_show_live_view(vt);
 
     if (on_off) {
 
@@ -531,6 +1050,11 @@ static void spiceterm_set_alternate_buffer(spiceTerm *vt, int on_off) {
             return;
         }
 
+        /* keep the rendered main screen, see below */
+        if (live && spiceterm_flush_damage(vt)) {
+            spice_screen_save_page(vt->screen, PAGE_MAIN_SCREEN);
+        }
+
         vt->altbuf = 1;
 
         /* alternate buffer & cursor */
@@ -568,6 +1092,10 @@ static void spiceterm_set_alternate_buffer(spiceTerm *vt, int on_off) {
         }
 
         spiceterm_restore_cursor(vt);
+
+        /* the refresh then only draws what changed meanwhile */
+        spice_screen_restore_page(vt->screen, PAGE_MAIN_SCREEN);
+        spice_screen_forget_page(vt->screen, PAGE_MAIN_SCREEN);
     }
 
     spiceterm_refresh(vt);
@@ -587,7 +1115,9 @@ static void spiceterm_set_mode(spiceTerm *vt, int on_off) {
             case 1049: /* start/end special app mode (smcup/rmcup) */
                 spiceterm_set_alternate_buffer(vt, on_off);
                 break;
-            case 25: /* Cursor on/off */
+            case 25: /* Cursor on/off (DECTCEM) */
+                vt->cursor_visible = on_off;
+                break;
             case 9: /* X10 mouse reporting on/off */
             case 6: /* Origin relative/absolute */
             case 1: /* Cursor keys in appl mode*/
@@ -667,7 +1197,7 @@ enum {
 };
 
 static void spiceterm_putchar(spiceTerm *vt, gunichar2 ch) {
-    int x, y, i, c;
+    int x, i, c;
 
     if (debug && !vt->tty_state) {
         DPRINTF(
@@ -892,25 +1422,13 @@ static void spiceterm_putchar(spiceTerm *vt, gunichar2 ch) {
             switch (vt->esc_buf[0]) {
             case 0:
                 /* clear to end of screen */
-                for (y = vt->cy; y < vt->height; y++) {
-                    for (x = 0; x < vt->width; x++) {
-                        if (y == vt->cy && x < vt->cx) {
-                            continue;
-                        }
-                        spiceterm_clear_xy(vt, x, y);
-                    }
-                }
+                spiceterm_clear_region(vt, vt->cx, vt->cy, vt->width, vt->cy + 1);
+                spiceterm_clear_region(vt, 0, vt->cy + 1, vt->width, vt->height);
                 break;
             case 1:
                 /* clear from beginning of screen */
-                for (y = 0; y <= vt->cy; y++) {
-                    for (x = 0; x < vt->width; x++) {
-                        if (y == vt->cy && x > vt->cx) {
-                            break;
-                        }
-                        spiceterm_clear_xy(vt, x, y);
-                    }
-                }
+                spiceterm_clear_region(vt, 0, 0, vt->width, vt->cy);
+                spiceterm_clear_region(vt, 0, vt->cy, vt->cx + 1, vt->cy + 1);
                 break;
             case 2:
                 /* clear entire screen */
@@ -922,21 +1440,15 @@ static void spiceterm_putchar(spiceTerm *vt, gunichar2 ch) {
             switch (vt->esc_buf[0]) {
             case 0:
                 /* clear to eol */
-                for (x = vt->cx; x < vt->width; x++) {
-                    spiceterm_clear_xy(vt, x, vt->cy);
-                }
+                spiceterm_clear_region(vt, vt->cx, vt->cy, vt->width, vt->cy + 1);
                 break;
             case 1:
                 /* clear from beginning of line */
-                for (x = 0; x <= vt->cx; x++) {
-                    spiceterm_clear_xy(vt, x, vt->cy);
-                }
+                spiceterm_clear_region(vt, 0, vt->cy, vt->cx + 1, vt->cy + 1);
                 break;
             case 2:
                 /* clear entire line */
-                for (x = 0; x < vt->width; x++) {
-                    spiceterm_clear_xy(vt, x, vt->cy);
-                }
+                spiceterm_clear_region(vt, 0, vt->cy, vt->width, vt->cy + 1);
                 break;
             }
             break;
@@ -982,24 +1494,10 @@ static void spiceterm_putchar(spiceTerm *vt, gunichar2 ch) {
             break;
         case 'P':
             /* delete c character */
-            c = vt->esc_buf[0];
+            x = MIN(vt->cx, vt->width - 1);
+            c = CLAMP(vt->esc_buf[0], 1, vt->width - x);
 
-            if (c > vt->width - vt->cx) {
-                c = vt->width - vt->cx;
-            } else if (!c) {
-                c = 1;
-            }
-
-            for (x = vt->cx; x < vt->width - c; x++) {
-                int y1 = (vt->y_base + vt->cy) % vt->total_height;
-                TextCell *dst = &vt->cells[y1 * vt->width + x];
-                TextCell *src = dst + c;
-                *dst = *src;
-                spiceterm_update_xy(vt, x + c, vt->cy);
-                src->ch = ' ';
-                src->attrib = vt->default_attrib;
-                spiceterm_update_xy(vt, x, vt->cy);
-            }
+            spiceterm_shift_row(vt, x, vt->cy, -c);
             break;
         case 's':
             /* save cursor position */
@@ -1020,31 +1518,14 @@ static void spiceterm_putchar(spiceTerm *vt, gunichar2 ch) {
                 c = vt->width - vt->cx;
             }
 
-            for (i = 0; i < c; i++) {
-                spiceterm_clear_xy(vt, vt->cx + i, vt->cy);
-            }
+            spiceterm_clear_region(vt, vt->cx, vt->cy, vt->cx + c, vt->cy + 1);
             break;
         case '@':
             /* insert c character */
-            c = vt->esc_buf[0];
-            if (c > (vt->width - vt->cx)) {
-                c = vt->width - vt->cx;
-            }
-            if (!c) {
-                c = 1;
-            }
-
-            for (x = vt->width - c; x >= vt->cx; x--) {
-                int y1 = (vt->y_base + vt->cy) % vt->total_height;
-                TextCell *src = &vt->cells[y1 * vt->width + x];
-                TextCell *dst = src + c;
-                *dst = *src;
-                spiceterm_update_xy(vt, x + c, vt->cy);
-                src->ch = ' ';
-                src->attrib = vt->cur_attrib;
-                spiceterm_update_xy(vt, x, vt->cy);
-            }
+            x = MIN(vt->cx, vt->width - 1);
+            c = CLAMP(vt->esc_buf[0], 1, vt->width - x);
 
+            spiceterm_shift_row(vt, x, vt->cy, c);
             break;
         case 'r':
             /* set region */
@@ -1202,8 +1683,6 @@ static void spiceterm_putchar(spiceTerm *vt, gunichar2 ch) {
 static int spiceterm_puts(spiceTerm *vt, const char *buf, int len) {
     gunichar2 tc;
 
-    spiceterm_show_cursor(vt, 0);
-
     while (len) {
         unsigned char c = *buf;
         len--;
@@ -1270,7 +1749,7 @@ static int spiceterm_puts(spiceTerm *vt, const char *buf, int len) {
         spiceterm_putchar(vt, tc);
     }
 
-    spiceterm_show_cursor(vt, 1);
+    spiceterm_schedule_flush(vt, FALSE);
 
     return len;
 }
@@ -1321,6 +1800,8 @@ void spiceterm_clear_selection(spiceTerm *vt) {
     vt->selection = NULL;
 
     spiceterm_unselect_all(vt);
+
+    spiceterm_schedule_flush(vt, TRUE);
 }
 
 void spiceterm_motion_event(spiceTerm *vt, uint32_t x, uint32_t y, uint32_t buttons) {
@@ -1375,10 +1856,7 @@ void spiceterm_motion_event(spiceTerm *vt, uint32_t x, uint32_t y, uint32_t butt
                         spiceterm_respond_unichar2(vt, vt->selection[i]);
                     }
                     spiceterm_update_watch_mask(vt, TRUE);
-                    if (vt->y_displ != vt->y_base) {
-                        vt->y_displ = vt->y_base;
-                        spiceterm_refresh(vt);
-                    }
+                    spiceterm_show_live_view(vt);
                 }
             } else {
                 vdagent_request_clipboard(vt);
@@ -1393,54 +1871,24 @@ void spiceterm_motion_event(spiceTerm *vt, uint32_t x, uint32_t y, uint32_t butt
     if (buttons & 2) {
         int pos = cy * vt->width + cx;
 
-        // code borrowed from libvncserver (VNCconsole.c)
-
         if (!vt->mark_active) {
-
-            spiceterm_unselect_all(vt);
-
             vt->mark_active = 1;
             sel_start_pos = sel_end_pos = pos;
-            spiceterm_toggle_marked_cell(vt, pos);
-
-        } else {
-
-            if (pos != sel_end_pos) {
-                if (pos > sel_end_pos) {
-                    cx = sel_end_pos;
-                    cy = pos;
-                } else {
-                    cx = pos;
-                    cy = sel_end_pos;
-                }
-
-                if (cx < sel_start_pos) {
-                    if (cy < sel_start_pos) {
-                        cy--;
-                    }
-                } else {
-                    cx++;
-                }
-
-                while (cx <= cy) {
-                    spiceterm_toggle_marked_cell(vt, cx);
-                    cx++;
-                }
-
-                sel_end_pos = pos;
+            spiceterm_select(vt, pos, pos);
+        } else if (pos != sel_end_pos) {
+            sel_end_pos = pos;
+            if (pos >= sel_start_pos) {
+                spiceterm_select(vt, sel_start_pos, pos);
+            } else {
+                spiceterm_select(vt, pos, sel_start_pos - 1);
             }
         }
 
     } else if (vt->mark_active) {
         vt->mark_active = 0;
 
-        if (sel_start_pos > sel_end_pos) {
-            int tmp = sel_start_pos - 1;
-            sel_start_pos = sel_end_pos;
-            sel_end_pos = tmp;
-        }
-
-        int len = sel_end_pos - sel_start_pos + 1;
+        int n = vt->total_height * vt->width;
+        int len = vt->sel_len;
 
         if (vt->selection) {
             free(vt->selection);
@@ -1449,18 +1897,15 @@ void spiceterm_motion_event(spiceTerm *vt, uint32_t x, uint32_t y, uint32_t butt
         vt->selection_len = len;
 
         for (i = 0; i < len; i++) {
-            int pos = sel_start_pos + i;
-            int x = pos % vt->width;
-            int y1 = ((pos / vt->width) + vt->y_displ) % vt->total_height;
-            TextCell *c = &vt->cells[y1 * vt->width + x];
-            vt->selection[i] = c->ch;
-            c++;
+            vt->selection[i] = vt->cells[(vt->sel_start + i) % n].ch;
         }
 
         DPRINTF(1, "selection length = %d", vt->selection_len);
 
         vdagent_grab_clipboard(vt);
     }
+
+    spiceterm_schedule_flush(vt, TRUE);
 }
 
 void init_spiceterm(spiceTerm *vt, uint32_t width, uint32_t height) {
@@ -1496,6 +1941,9 @@ void init_spiceterm(spiceTerm *vt, uint32_t width, uint32_t height) {
 
     vt->cur_attrib = vt->default_attrib;
 
+    vt->cursor_visible = TRUE;
+    vt->sel_len = 0;
+
     if (vt->cells) {
         vt->cx = 0;
         vt->cy = 0;
@@ -1516,11 +1964,23 @@ void init_spiceterm(spiceTerm *vt, uint32_t width, uint32_t height) {
     }
 
     vt->altcells = (TextCell *)calloc(sizeof(TextCell), vt->width * vt->height);
+
+    g_free(vt->dirty_x1);
+    g_free(vt->dirty_x2);
+    vt->dirty_x1 = g_new0(int, vt->height);
+    vt->dirty_x2 = g_new0(int, vt->height);
+    vt->damaged = FALSE;
+    vt->pending_scroll = 0;
+    vt->cursor_drawn = FALSE;
+
+    if (!vt->flush_timer) {
+        vt->flush_timer = vt->screen->core->timer_add(spiceterm_flush_timeout, vt);
+    }
 }
 
 void spiceterm_resize(spiceTerm *vt, uint32_t width, uint32_t height) {
-    width = (width / 8) * 8;
-    height = (height / 16) * 16;
+    width = (CLAMP(width, 8, MAX_WIDTH) / 8) * 8;
+    height = (CLAMP(height, 16, MAX_HEIGHT) / 16) * 16;
 
     if (vt->screen->width == width && vt->screen->height == height) {
         return;
@@ -1532,6 +1992,9 @@ void spiceterm_resize(spiceTerm *vt, uint32_t width, uint32_t height) {
 
     init_spiceterm(vt, width, height);
 
+    /* draw the cursor on the new screen */
+    spiceterm_schedule_flush(vt, FALSE);
+
     struct winsize dimensions;
     dimensions.ws_col = vt->width;
     dimensions.ws_row = vt->height;
@@ -1573,15 +2036,25 @@ static void master_watch(int master, int event, void *opaque) {
 
     if (event == SPICE_WATCH_EVENT_READ) {
         char buffer[1024];
-        while ((c = read(master, buffer, 1024)) == -1) {
-            if (errno != EAGAIN) {
+        int total = 0;
+        while (total < PTY_READ_BUDGET) {
+            if ((c = read(master, buffer, sizeof(buffer))) <= 0) {
+                if (c == -1 && errno != EAGAIN) {
+                    perror("master pipe read error"); // fixme
+                }
                 break;
             }
+            spiceterm_puts(vt, buffer, c);
+            total += c;
         }
-        if (c == -1) {
-            perror("master pipe read error"); // fixme
-        }
-        spiceterm_puts(vt, buffer, c);
+
+        /* A full budget of waiting output means it comes in faster than we
+         * can show it. Jump scroll then: only the emulation advances, and
+         * the flush timer paints the current state now and then. Running
+         * out of data ends the burst, so show the result now.
+         */
+        vt->jump_scroll = total >= PTY_READ_BUDGET;
+        spiceterm_schedule_flush(vt, TRUE);
     } else {
         if (vt->ibuf_count > 0) {
             DPRINTF(1, "write input %x %d", vt->ibuf[0], vt->ibuf_count);
@@ -1619,6 +2092,61 @@ static void spiceterm_print_usage(const char *msg) {
     fprintf(stderr, "  --addr <addr>        Bind to address <addr>\n");
     fprintf(stderr, "  --noauth             Disable authentication\n");
     fprintf(stderr, "  --keymap             Spefify keymap (uses kvm keymap files)\n");
+    fprintf(stderr, "  --flush-interval <ms>\n");
+    fprintf(stderr, "                       Coalesce screen updates (default 16 ms, 0 = off)\n");
+    fprintf(stderr, "  --max-flush-interval <ms>\n");
+    fprintf(stderr, "                       Coalesce up to this time on slow links (default\n");
+    fprintf(stderr, "                       200 ms, off with --flush-interval 0)\n");
+    fprintf(stderr, "  --image-cache <KiB>  Glyph bitmap cache size (default 4096 KiB,\n");
+    fprintf(stderr, "                       only with --truecolor-glyphs)\n");
+    fprintf(stderr, "  --glyph-atlas <path> Use (and create) a shared prerendered glyph atlas\n");
+    fprintf(stderr, "                       (only with --truecolor-glyphs)\n");
+    fprintf(stderr, "  --truecolor-glyphs   Send text as 32bit instead of palettized bitmaps\n");
+    fprintf(stderr, "  --image-compression <off|auto_glz|auto_lz|quic|glz|lz|lz4|adaptive>\n");
+    fprintf(stderr, "                       Image compression\n");
+    fprintf(stderr, "  --jpeg-compression <auto|always|never>\n");
+    fprintf(stderr, "                       Lossy compression for WAN connections\n");
+    fprintf(stderr, "  --zlib-glz-compression <auto|always|never>\n");
+    fprintf(stderr, "                       Additional zlib compression of glz images\n");
+    fprintf(stderr, "  --streaming-video <off|all|filter>\n");
+    fprintf(stderr, "                       Video stream detection\n");
+    fprintf(stderr, "  --text-compression   Compression preset for text terminals\n");
+}
+
+static const char *image_compression_names[] = {
+    [SPICE_IMAGE_COMPRESSION_OFF] = "off",
+    [SPICE_IMAGE_COMPRESSION_AUTO_GLZ] = "auto_glz",
+    [SPICE_IMAGE_COMPRESSION_AUTO_LZ] = "auto_lz",
+    [SPICE_IMAGE_COMPRESSION_QUIC] = "quic",
+    [SPICE_IMAGE_COMPRESSION_GLZ] = "glz",
+    [SPICE_IMAGE_COMPRESSION_LZ] = "lz",
+    [SPICE_IMAGE_COMPRESSION_LZ4] = "lz4",
+};
+
+static const char *wan_compression_names[] = {
+    [SPICE_WAN_COMPRESSION_AUTO] = "auto",
+    [SPICE_WAN_COMPRESSION_ALWAYS] = "always",
+    [SPICE_WAN_COMPRESSION_NEVER] = "never",
+};
+
+static const char *streaming_video_names[] = {
+    [SPICE_STREAM_VIDEO_OFF] = "off",
+    [SPICE_STREAM_VIDEO_ALL] = "all",
+    [SPICE_STREAM_VIDEO_FILTER] = "filter",
+};
+
+/* returns the index of 'arg' in 'names', exits on unknown values */
+static int spiceterm_parse_choice(const char *arg, const char **names, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (names[i] && !strcmp(names[i], arg)) {
+            return i;
+        }
+    }
+
+    spiceterm_print_usage("invalid option value");
+    exit(-1);
 }
 
 int main(int argc, char **argv) {
@@ -1629,11 +2157,15 @@ int main(int argc, char **argv) {
     int master;
     char ptyname[1024];
     struct winsize dimensions;
+    gboolean text_compression = FALSE;
     SpiceTermOptions opts = {
         .timeout = 10,
         .port = 5900,
         .addr = NULL,
         .noauth = FALSE,
+        .flush_interval = 16,
+        .max_flush_interval = 200,
+        .image_cache_size = 4096,
     };
 
     static struct option long_options[] = {
@@ -1644,10 +2176,21 @@ int main(int argc, char **argv) {
         {"addr", required_argument, 0, 'a'},
         {"keymap", required_argument, 0, 'k'},
         {"noauth", no_argument, 0, 'n'},
+        {"flush-interval", required_argument, 0, 'f'},
+        {"max-flush-interval", required_argument, 0, 'F'},
+        {"image-cache", required_argument, 0, 'c'},
+        {"glyph-atlas", required_argument, 0, 'g'},
+        {"truecolor-glyphs", no_argument, 0, 'T'},
+        {"image-compression", required_argument, 0, 'i'},
+        {"jpeg-compression", required_argument, 0, 'j'},
+        {"zlib-glz-compression", required_argument, 0, 'z'},
+        {"streaming-video", required_argument, 0, 'v'},
+        {"text-compression", no_argument, 0, 'x'},
         {NULL, 0, 0, 0},
     };
 
-    while ((c = getopt_long(argc, argv, "nkt:a:p:P:", long_options, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "nkTxt:a:p:P:f:F:c:g:i:j:z:v:", long_options, NULL)) !=
+           -1) {
         switch (c) {
         case 'n':
             opts.noauth = TRUE;
@@ -1670,6 +2213,50 @@ int main(int argc, char **argv) {
         case 't':
             opts.timeout = atoi(optarg);
             break;
+        case 'f':
+            opts.flush_interval = atoi(optarg);
+            break;
+        case 'F':
+            opts.max_flush_interval = atoi(optarg);
+            break;
+        case 'c':
+            opts.image_cache_size = atoi(optarg);
+            break;
+        case 'g':
+            opts.glyph_atlas = optarg;
+            break;
+        case 'T':
+            opts.truecolor_glyphs = TRUE;
+            break;
+        case 'i':
+            if (!strcmp(optarg, "adaptive")) {
+                opts.adaptive_compression = TRUE;
+                opts.image_compression = 0;
+            } else {
+                opts.adaptive_compression = FALSE;
+                opts.image_compression = spiceterm_parse_choice(
+                    optarg, image_compression_names, G_N_ELEMENTS(image_compression_names)
+                );
+            }
+            break;
+        case 'j':
+            opts.jpeg_compression = spiceterm_parse_choice(
+                optarg, wan_compression_names, G_N_ELEMENTS(wan_compression_names)
+            );
+            break;
+        case 'z':
+            opts.zlib_glz_compression = spiceterm_parse_choice(
+                optarg, wan_compression_names, G_N_ELEMENTS(wan_compression_names)
+            );
+            break;
+        case 'v':
+            opts.streaming_video = spiceterm_parse_choice(
+                optarg, streaming_video_names, G_N_ELEMENTS(streaming_video_names)
+            );
+            break;
+        case 'x':
+            text_compression = TRUE;
+            break;
         case '?':
             spiceterm_print_usage(NULL);
             exit(-1);
@@ -1680,6 +2267,23 @@ int main(int argc, char **argv) {
         }
     }
 
+    /* text is never video and must not get blurred by jpeg, explicit
+     * options win over the preset */
+    if (text_compression) {
+        if (!opts.image_compression) {
+            opts.adaptive_compression = TRUE;
+        }
+        if (!opts.jpeg_compression) {
+            opts.jpeg_compression = SPICE_WAN_COMPRESSION_NEVER;
+        }
+        if (!opts.zlib_glz_compression) {
+            opts.zlib_glz_compression = SPICE_WAN_COMPRESSION_AUTO;
+        }
+        if (!opts.streaming_video) {
+            opts.streaming_video = SPICE_STREAM_VIDEO_OFF;
+        }
+    }
+
     if (optind < argc) {
         command = argv[optind];
         cmdargv = &argv[optind];
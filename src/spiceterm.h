@@ -1,5 +1,6 @@
 #include <glib.h>
 #include <spice.h>
+#include <stdatomic.h>
 
 #define IBUFSIZE 1024
 #define MAX_ESC_PARAMS 16
@@ -12,7 +13,6 @@ typedef struct TextAttributes {
     unsigned int blink : 1;
     unsigned int invers : 1;
     unsigned int unvisible : 1;
-    unsigned int selected : 1;
 } TextAttributes;
 
 typedef struct TextCell {
@@ -21,8 +21,9 @@ typedef struct TextCell {
 } TextCell;
 
 #define COMMANDS_SIZE (1024)
-#define MAX_HEIGHT 1440
-#define MAX_WIDTH 2560
+#define MAX_HEIGHT 4320
+#define MAX_WIDTH 8192
+#define BAND_ROWS 8 // text rows per bitmap for full row repaints (spice_screen_draw_band)
 
 typedef struct SpiceTermOptions {
     guint timeout;
@@ -30,15 +31,50 @@ typedef struct SpiceTermOptions {
     char *addr;
     char *keymap;
     gboolean noauth;
+    guint flush_interval; // ms
+    guint max_flush_interval; // ms, upper bound on congested links, 0 = fixed interval
+    guint image_cache_size; // KiB
+    char *glyph_atlas; // path of the shared glyph atlas file
+    gboolean truecolor_glyphs; // send text as 32bit instead of palettized bitmaps
+    int image_compression; // SpiceImageCompression, 0 = server default
+    int jpeg_compression; // SpiceWanCompression, 0 = server default
+    int zlib_glz_compression; // SpiceWanCompression, 0 = server default
+    int streaming_video; // SPICE_STREAM_VIDEO_*, 0 = server default
+    gboolean adaptive_compression; // pick LZ or GLZ by the command ring drain rate
 } SpiceTermOptions;
 
 typedef struct SpiceScreen SpiceScreen;
 
+// what the producer remembers about a queued command (see supersede_commands)
+typedef struct QueuedCommandInfo {
+    QXLRect bbox;
+    uint32_t surface_id;
+    gboolean opaque_paint;
+} QueuedCommandInfo;
+
 typedef struct CachedImage {
     uint8_t *bitmap;
-    int cache_id;
+    uint64_t cache_id;
+    gsize size; // accounted memory
+    gint refcount; // held by the cache and by each queued command
+    GList lru_link;
 } CachedImage;
 
+#define IMAGE_CACHE_MAX_ENTRIES 16384
+#define SPAN_SEEN_SIZE 4096 // recently drawn text spans (see span_cache_id)
+
+// screen contents kept in an off-screen surface (see spice_screen_save_page)
+#define SCREEN_PAGES 4
+#define SCREEN_PAGES_BUDGET (16 * 1024 * 1024) // bytes, fewer pages on big screens
+
+typedef struct SavedPage {
+    uint8_t *data; // surface memory, NULL if the surface does not exist
+    uint32_t *shadow; // shadow grid at the time of saving
+    int key;
+    gboolean valid;
+    guint64 used;
+} SavedPage;
+
 struct SpiceScreen {
     SpiceCoreInterface *core;
     SpiceServer *server;
@@ -46,7 +82,7 @@ struct SpiceScreen {
     QXLInstance qxl_instance;
     QXLWorker *qxl_worker;
 
-    uint8_t primary_surface[MAX_HEIGHT * MAX_WIDTH * 4];
+    uint8_t *primary_surface; // allocated by create_primary_surface
     int primary_height;
     int primary_width;
 
@@ -59,18 +95,45 @@ struct SpiceScreen {
     int width;
     int height;
 
-    GCond command_cond;
-    GMutex command_mutex;
-
-    int commands_end;
-    int commands_start;
-    struct QXLCommandExt *commands[COMMANDS_SIZE];
+    /* single producer (main loop), single consumer (red_worker) command ring;
+     * C11 atomics instead of g_atomic_*, because the ring relies on explicit
+     * relaxed/acquire/release orders (see push_command)
+     */
+    atomic_uint commands_end __attribute__((aligned(64))); // written by the producer
+    atomic_uint commands_start __attribute__((aligned(64))); // written by the consumer
+    _Atomic(struct QXLCommandExt *) commands[COMMANDS_SIZE] __attribute__((aligned(64)));
+    QueuedCommandInfo command_info[COMMANDS_SIZE]; // producer only
+
+    // adaptive image compression (see compression_sample)
+    SpiceTimer *compression_timer;
+    int image_compression;
+    unsigned int compression_last_start;
+    unsigned int compression_lz_drained; // commands per sample with LZ before switching to GLZ
+    guint compression_hold_samples; // stay with LZ for this many samples
+    guint ring_full_count; // times a draw found the command ring full (main loop only)
+    guint compression_relaxed_samples;
 
     // cache for glyphs bitmaps
     GHashTable *image_cache;
+    GQueue image_cache_lru;
+    gsize image_cache_bytes;
+    gsize image_cache_max_bytes;
+    guint64 image_cache_hits;
+    guint64 image_cache_misses;
+    guint64 image_cache_evictions;
+
+    uint64_t span_seen[SPAN_SEEN_SIZE];
 
     gboolean cursor_set;
 
+    // last drawn glyph_cache_key per cell (see shadow_reset)
+    uint32_t *shadow;
+    int shadow_cols;
+    int shadow_rows;
+
+    SavedPage pages[SCREEN_PAGES];
+    guint64 page_clock;
+
     // callbacks
     void (*on_client_connected)(SpiceScreen *spice_screen);
     void (*on_client_disconnected)(SpiceScreen *spice_screen);
@@ -80,13 +143,24 @@ SpiceScreen *
 spice_screen_new(SpiceCoreInterface *core, uint32_t width, uint32_t height, SpiceTermOptions *opts);
 
 void spice_screen_resize(SpiceScreen *spice_screen, uint32_t width, uint32_t height);
-void spice_screen_draw_char(
-    SpiceScreen *spice_screen, int x, int y, gunichar2 ch, TextAttributes attrib
+// the drawing functions return FALSE (and draw nothing) if the command ring is full
+gboolean spice_screen_draw_text(
+    SpiceScreen *spice_screen, int x, int y, TextCell *cells, int count, int inv_x1, int inv_x2
 );
-void spice_screen_scroll(
+guint spice_screen_backlog(SpiceScreen *spice_screen);
+gboolean spice_screen_draw_band(
+    SpiceScreen *spice_screen, int y, TextCell *const *rows, int count, int cols
+);
+gboolean spice_screen_scroll(
     SpiceScreen *spice_screen, int x1, int y1, int x2, int y2, int src_x, int src_y
 );
-void spice_screen_clear(SpiceScreen *spice_screen, int x1, int y1, int x2, int y2);
+gboolean spice_screen_clear(
+    SpiceScreen *spice_screen, int x1, int y1, int x2, int y2, TextAttributes attrib
+);
+gboolean spice_screen_invert(SpiceScreen *spice_screen, int x1, int y1, int x2, int y2);
+gboolean spice_screen_save_page(SpiceScreen *spice_screen, int key);
+gboolean spice_screen_restore_page(SpiceScreen *spice_screen, int key);
+void spice_screen_forget_page(SpiceScreen *spice_screen, int key);
 uint32_t spice_screen_get_width(void);
 uint32_t spice_screen_get_height(void);
 
@@ -111,6 +185,27 @@ typedef struct spiceTerm {
     TextCell *cells;
     TextCell *altcells;
 
+    // damaged cells [dirty_x1, dirty_x2) per display row
+    int *dirty_x1;
+    int *dirty_x2;
+    gboolean damaged;
+    int pending_scroll; // lines the screen pixels still have to move up
+
+    SpiceTimer *flush_timer;
+    guint flush_interval; // ms, 0 = flush after each write (see spiceterm_adapt_flush_interval)
+    guint min_flush_interval; // ms, the configured flush_interval
+    guint max_flush_interval; // ms
+    gboolean flush_pending;
+    gint64 last_flush;
+    gboolean jump_scroll; // flooded by the pty, draw frames only (see master_watch)
+
+    gboolean cursor_visible; // DECTCEM
+
+    // cursor position as currently drawn on the screen
+    gboolean cursor_drawn;
+    int cursor_x;
+    int cursor_y;
+
     SpiceScreen *screen;
     SpiceKbdInstance keyboard_sin;
     SpiceCharDeviceInstance vdagent_sin;
@@ -146,6 +241,11 @@ typedef struct spiceTerm {
     gunichar2 *selection;
     int selection_len;
 
+    // the marked cells: sel_len cells starting at cells[sel_start], wrapping
+    // around the end of the buffer (shown inverted, see spiceterm_selected_cols)
+    int sel_start;
+    int sel_len;
+
     unsigned int mark_active : 1;
 
     unsigned int report_mouse : 1;
@@ -157,6 +257,7 @@ void spiceterm_refresh(spiceTerm *vt);
 
 void spiceterm_resize(spiceTerm *vt, uint32_t width, uint32_t height);
 void spiceterm_virtual_scroll(spiceTerm *vt, int lines);
+void spiceterm_show_live_view(spiceTerm *vt);
 void spiceterm_clear_selection(spiceTerm *vt);
 void spiceterm_motion_event(spiceTerm *vt, uint32_t x, uint32_t y, uint32_t buttons);
 